@@ -0,0 +1,171 @@
+/*
+ * artnet.c
+ *
+ * Art-Net on its own UDP socket. Every datagram queued since the last pass
+ * is walked in the RX ring with one RECV for the lot. The ArtDmx header is
+ * read first and only universes in the store have their data copied, the
+ * rest is skipped without touching the SPI bus again. ArtPoll is answered
+ * with a unicast ArtPollReply to the poller.
+ */
+
+#include "defines.h"
+#include "w5500.h"
+#include "wizevent.h"
+#include "msp430server.h"
+#include "artnet.h"
+
+ArtNetStats artNetStats;
+
+static const u_char _artnet_id[8] = { 'A', 'r', 't', '-', 'N', 'e', 't', 0 };
+static const u_char _artnet_short_name[] = "MSP432 DMX";
+static const u_char _artnet_long_name[] = "MSP432 W5500 DMX node";
+static u_char _sequence[DMX_UNIVERSES];	// last ArtDmx sequence per universe, 0 when unused
+
+#define ARTNET_PROTOCOL_VERSION	14
+#define ARTNET_REORDER_WINDOW	16		// a sequence this far behind the last one is a late packet
+
+void startArtNet(void) {
+	u_char u;
+
+	for (u = 0; u < DMX_UNIVERSES; u++) {
+		_sequence[u] = 0;
+	}
+	setSocketEventHandler(ARTNET_SOCKET, Sn_IR_RECV, 0);
+	socket(ARTNET_SOCKET, Sn_MR_UDP, ARTNET_PORT, 0);
+}
+
+static u_char isArtNet(const u_char *header) {
+	u_char c;
+
+	for (c = 0; c < 8; c++) {
+		if (header[c] != _artnet_id[c])
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * ArtDmx: header[14] SubUni, header[15] Net, header[16..17] Length (big endian)
+ */
+static void receiveDmx(DatagramReader *reader, const u_char *header) {
+	u_int address = ((header[15] & 0x7F) << 8) | header[14];
+	u_int universe = address - ARTNET_UNIVERSE_BASE;
+	u_int length = ntohs((u_char *) header + 16);
+	u_char sequence = header[12];
+
+	// unsigned, an address below the base wraps past DMX_UNIVERSES as well
+	if (universe >= DMX_UNIVERSES) {
+		artNetStats.filtered++;
+		return;
+	}
+	if (sequence && _sequence[universe]
+			&& (u_char) (_sequence[universe] - sequence) != 0
+			&& (u_char) (_sequence[universe] - sequence) <= ARTNET_REORDER_WINDOW) {
+		artNetStats.stale++;
+		return;
+	}
+	_sequence[universe] = sequence;
+	if (length > DMX_CHANNELS) {
+		length = DMX_CHANNELS;
+	}
+	// straight from the ring into the store
+	readDatagram(reader, dmx[universe], length);
+	recordEventLatency(&artNetStats.latency);
+	artNetStats.frames++;
+}
+
+/*
+ * ArtPollReply built as a vector, the zero runs are filled on the SPI bus
+ */
+static void replyToPoll(DatagramReader *reader) {
+	u_char head[26], ports[28], tail[13];
+	SPIVector reply[8];
+	u_char c, count = DMX_UNIVERSES < 4 ? DMX_UNIVERSES : 4;
+
+	for (c = 0; c < 8; c++) {
+		head[c] = _artnet_id[c];
+	}
+	head[8] = ARTNET_OP_POLL_REPLY & 0xFF;
+	head[9] = ARTNET_OP_POLL_REPLY >> 8;
+	getSIPR(head + 10);
+	head[14] = ARTNET_PORT & 0xFF;
+	head[15] = ARTNET_PORT >> 8;
+	head[16] = 0;					// VersInfo
+	head[17] = 1;
+	head[18] = (ARTNET_UNIVERSE_BASE >> 8) & 0x7F;	// NetSwitch
+	head[19] = (ARTNET_UNIVERSE_BASE >> 4) & 0x0F;	// SubSwitch
+	head[20] = 0x00;				// Oem, unknown
+	head[21] = 0xFF;
+	head[22] = 0;					// Ubea
+	head[23] = 0xD0;				// Status1: indicators normal, network configured
+	head[24] = 0;					// EstaMan
+	head[25] = 0;
+
+	for (c = 0; c < sizeof(ports); c++) {
+		ports[c] = 0;
+	}
+	ports[1] = count;				// NumPorts
+	for (c = 0; c < count; c++) {
+		ports[2 + c] = 0x80;		// PortTypes: DMX512 output
+		ports[10 + c] = 0x80;		// GoodOutput: data being transmitted
+		ports[18 + c] = (ARTNET_UNIVERSE_BASE + c) & 0x0F;	// SwOut
+	}
+
+	tail[0] = 0x00;					// Style: StNode
+	getSHAR(tail + 1);
+	getSIPR(tail + 7);				// BindIp
+	tail[11] = 1;					// BindIndex
+	tail[12] = 0x08;				// Status2: 15 bit Port-Address
+
+	reply[0].array = head;					reply[0].length = sizeof(head);
+	reply[1].array = _artnet_short_name;	reply[1].length = sizeof(_artnet_short_name) - 1;
+	reply[2].array = 0;						reply[2].length = 18 - reply[1].length;
+	reply[2].value = 0;
+	reply[3].array = _artnet_long_name;		reply[3].length = sizeof(_artnet_long_name) - 1;
+	reply[4].array = 0;						reply[4].length = 64 - reply[3].length + 64;	// LongName pad, NodeReport
+	reply[4].value = 0;
+	reply[5].array = ports;					reply[5].length = sizeof(ports);
+	reply[6].array = tail;					reply[6].length = sizeof(tail);
+	reply[7].array = 0;						reply[7].length = 26;	// Filler
+	reply[7].value = 0;
+
+	artNetStats.polls++;
+	if (writeToTXBufferVector(ARTNET_SOCKET, reply, 8)) {
+		sendto(ARTNET_SOCKET, 0, 0, reader->addr, ARTNET_PORT);
+	}
+}
+
+/*
+ * Drain everything queued on the Art-Net socket, returns 1 if anything was
+ */
+u_char serviceArtNet(void) {
+	DatagramReader reader;
+	u_char header[ARTNET_HEADER_SIZE];
+	u_int length, opcode;
+
+	if (!takeSocketEvents(ARTNET_SOCKET, Sn_IR_RECV))
+		return 0;
+	openDatagrams(&reader, ARTNET_SOCKET);
+	while (nextDatagram(&reader)) {
+		length = readDatagram(&reader, header, ARTNET_HEADER_SIZE);
+		if (length < 12 || !isArtNet(header)
+				|| ntohs(header + 10) < ARTNET_PROTOCOL_VERSION) {
+			artNetStats.ignored++;
+			continue;
+		}
+		opcode = header[8] | (header[9] << 8);
+		if (opcode == ARTNET_OP_DMX && length == ARTNET_HEADER_SIZE) {
+			receiveDmx(&reader, header);
+		} else if (opcode == ARTNET_OP_POLL) {
+			replyToPoll(&reader);
+		} else {
+			artNetStats.ignored++;
+		}
+	}
+	commitDatagrams(&reader);
+	return 1;
+}
+
+void reportArtNetLatency(void) {
+	reportEventLatency("Art-Net", &artNetStats.latency);
+}
@@ -0,0 +1,34 @@
+/*
+ * artnet.h
+ *
+ * Art-Net receiver: ArtDmx into the dmx[][] store, ArtPoll answered
+ */
+
+#ifndef ARTNET_H_
+#define ARTNET_H_
+
+#include "typedefs.h"
+#include "wizevent.h"
+
+#define ARTNET_OP_POLL			0x2000
+#define ARTNET_OP_POLL_REPLY	0x2100
+#define ARTNET_OP_DMX			0x5000
+#define ARTNET_HEADER_SIZE		18		// ArtDmx up to the data, longest header we decode
+#define ARTNET_POLL_REPLY_SIZE	239
+
+typedef struct {
+	u_long frames;			// ArtDmx written to the store
+	u_long filtered;		// ArtDmx for universes we don't keep
+	u_long stale;			// ArtDmx behind the last sequence
+	u_long polls;
+	u_long ignored;			// not Art-Net or an OpCode we don't handle
+	EventLatency latency;	// INTn to ArtDmx data in the store
+} ArtNetStats;
+
+extern ArtNetStats artNetStats;
+
+void startArtNet(void);
+u_char serviceArtNet(void);
+void reportArtNetLatency(void);
+
+#endif /* ARTNET_H_ */
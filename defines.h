@@ -9,17 +9,35 @@
 //
 //#define RESPONSE_TYPE_HTML
 //
-#define TX_MAX_BUF_SIZE			0x0F // we can go up to 256, but we would have to decrease RX down to 64, 256/64 (G2553 chip)
-#define RX_MAX_BUF_SIZE			0x0F //
+#define TX_MAX_BUF_SIZE			0x80 // response staging per connection, up to 255; drained into the socket's TX memory
+#define RX_MAX_BUF_SIZE			0x200 // request window per connection, mapped from the socket's RX memory
 //
 /* Ethernet controller pin and SPI definitions */
 #define ETH_EUSCI_MODULE 		EUSCI_A3_BASE
 #define ETH_EUSCI_REC_INT		EUSCI_A_SPI_RECEIVE_INTERRUPT
 #define ETH_EUSCI_TRAN_INT		EUSCI_A_SPI_TRANSMIT_INTERRUPT
 #define ETH_INT_ENABLE 			INT_EUSCIA3
+#define ETH_EUSCI				EUSCI_A3	// direct register access
+//
+#define ETH_DMA_TX_CHANNEL		DMA_CH6_EUSCIA3TX
+#define ETH_DMA_RX_CHANNEL		DMA_CH7_EUSCIA3RX
+#define ETH_DMA_TX_CHANNEL_NUM	6
+#define ETH_DMA_RX_CHANNEL_NUM	7
+#define ETH_DMA_MAX_TRANSFER	1024	// uDMA basic mode limit per cycle
+#define SPI_DMA_THRESHOLD		16		// shorter payloads are clocked out by the RX interrupt
+#define SPI_QUEUE_SIZE			8		// pending SPI transactions
+#define WIZ_RAM_HOT_PATH		0		// 1: run the per-byte SPI and buffer code from SRAM_CODE
+#define DEBUG_REPORTS			0		// 1: print timing reports over the debug console
+#define DEBUG_REPORT_INTERVAL	10000	// ms between periodic reports
+#define SPI_CLOCK_DEFAULT		8000000	// used until calibrateSPIClock() has run
+#define SPI_CLOCK_MAX			24000000	// upper bound for calibration
+#define SPI_CALIBRATION_SOCKET	7		// TX buffer used for the readback pattern
+#define SPI_CALIBRATION_ROUNDS	8
 
 #define ETH_CS_PIN 				GPIO_PIN4	//ETH CS P9.4
 #define ETH_CS_PORT 			GPIO_PORT_P9
+#define ETH_CS_OUT				P9->OUT		// bit-band chip select
+#define ETH_CS_BIT				4
 
 #define ETH_SCLK_PIN 			GPIO_PIN5	//ETH CLK P9.5
 #define ETH_SCLK_PORT 			GPIO_PORT_P9
@@ -30,8 +48,40 @@
 #define ETH_MOSI_PIN 			GPIO_PIN7	//ETH MOSI P9.7
 #define ETH_MOSI_PORT 			GPIO_PORT_P9
 
+// W5500 INTn, not wired on the stock board so SIR is polled by default.
+// Connect the module's INTn to P6.4 (open drain, pulled up here) and uncomment.
+//#define ETH_INTN_PIN			GPIO_PIN4	//ETH INTn P6.4
+//#define ETH_INTN_PORT			GPIO_PORT_P6
+//#define ETH_INTN_INT			INT_PORT6
+//#define ETH_INTN_IRQHandler		PORT6_IRQHandler
+
+// W5500 SPI framing
+#define WIZ_SPI_VDM				0	// variable length frames delimited by SCSn
+#define WIZ_SPI_FDM				1	// fixed 1/2/4 byte frames, SCSn held low (or tied low on the board)
+#define WIZ_SPI_MODE			WIZ_SPI_VDM
+
+// hot path placement, .TI.ramfunc is copied to SRAM_CODE by the boot routine (BINIT table)
+#if WIZ_RAM_HOT_PATH && defined(__TI_COMPILER_VERSION__)
+#define WIZ_RAMFUNC				__attribute__((ramfunc))
+#else
+#define WIZ_RAMFUNC
+#endif
+
+// chip select drive
+#define WIZ_CS_GPIO				0	// driverlib GPIO calls
+#define WIZ_CS_BITBAND			1	// single store to the P9OUT bit-band alias
+#define WIZ_CS_MODE				WIZ_CS_GPIO
+
+#if WIZ_SPI_MODE == WIZ_SPI_FDM
+#define WIZ_SELECT
+#define WIZ_DESELECT
+#elif WIZ_CS_MODE == WIZ_CS_BITBAND
+#define WIZ_SELECT				BITBAND_PERI(ETH_CS_OUT, ETH_CS_BIT) = 0;
+#define WIZ_DESELECT			BITBAND_PERI(ETH_CS_OUT, ETH_CS_BIT) = 1;
+#else
 #define WIZ_SELECT				GPIO_setOutputLowOnPin(ETH_CS_PORT, ETH_CS_PIN);
 #define WIZ_DESELECT			GPIO_setOutputHighOnPin(ETH_CS_PORT, ETH_CS_PIN);
+#endif
 
 //
 #define wizPowerUp()			WIZ_POWER_UP
@@ -43,10 +93,58 @@
 //
 #define SOCK_CONFIG				2	// UDP
 #define SOCK_DNS				2	// UDP
-#define SOCK_DHCP				3	// UDP
+#define SOCK_DHCP				7	// UDP, shares the calibration socket, which is only used at boot
 #define MAX_BUF_SIZE			1460
 #define KEEP_ALIVE_TIME			30	// 30 sec
 #define	MAX_SOCK_NUM			8
+#define MACRAW_ENABLE			0	// 1: socket 0 carries raw Ethernet frames, the HTTP pool moves up one
+#define MACRAW_SOCKET			0	// MACRAW only works on socket 0
+#define MACRAW_FRAME_SIZE		256	// frame bytes handed to the handler, the rest is skipped
+#if MACRAW_ENABLE
+#define HTTP_SOCKET_FIRST		1
+#define HTTP_SOCKETS			2	// sockets HTTP_SOCKET_FIRST.. listen on the HTTP port
+#else
+#define HTTP_SOCKET_FIRST		0
+#define HTTP_SOCKETS			3
+#endif
+#define HTTP_BACKLOG			1	// sockets always kept in SOCK_LISTEN, idle keep-alives give way
+#define HTTP_IDLE_TIMEOUT		5000	// ms a kept-alive connection may stay quiet
+#define HTTP_DISCONNECT_TIMEOUT	1000	// ms to wait for the peer's FIN before closing
+#define SOCKET_COMMAND_TIMEOUT	100	// ms for OPEN/LISTEN/CLOSE to reach their status
+//
+#define DMX_UNIVERSES			2	// dmx[][] store, set over HTTP and Art-Net
+#define DMX_CHANNELS			512
+#define ARTNET_SOCKET			3	// UDP
+#define ARTNET_PORT				6454
+#define ARTNET_UNIVERSE_BASE	0	// 15 bit Port-Address of dmx[0], the store must not cross a 16 universe boundary
+#define SACN_SOCKET				4	// first of SACN_UNIVERSES multicast UDP sockets, one group each
+#define SACN_UNIVERSES			2
+#define SACN_UNIVERSE_FIRST		1	// E1.31 universe of dmx[0]
+#define SACN_PORT				5568
+#define DMXUDP_SOCKET			6	// binary DMX protocol, UDP
+#define DMXUDP_PORT				6455
+
+// each service owns its sockets, DHCP only shares with the boot-time SPI calibration
+#define SOCKETS_OVERLAP(a, n, b, m)	((a) < (b) + (m) && (b) < (a) + (n))
+#if SOCKETS_OVERLAP(ARTNET_SOCKET, 1, HTTP_SOCKET_FIRST, HTTP_SOCKETS) \
+		|| SOCKETS_OVERLAP(ARTNET_SOCKET, 1, SACN_SOCKET, SACN_UNIVERSES) \
+		|| ARTNET_SOCKET == DMXUDP_SOCKET || ARTNET_SOCKET == SOCK_DHCP \
+		|| (MACRAW_ENABLE && ARTNET_SOCKET == MACRAW_SOCKET)
+#error "ARTNET_SOCKET is used by another service"
+#endif
+#if SOCKETS_OVERLAP(SOCK_DHCP, 1, HTTP_SOCKET_FIRST, HTTP_SOCKETS) \
+		|| SOCKETS_OVERLAP(SOCK_DHCP, 1, SACN_SOCKET, SACN_UNIVERSES) \
+		|| SOCK_DHCP == DMXUDP_SOCKET || (MACRAW_ENABLE && SOCK_DHCP == MACRAW_SOCKET)
+#error "SOCK_DHCP is used by another service"
+#endif
+#if SOCKETS_OVERLAP(SACN_SOCKET, SACN_UNIVERSES, HTTP_SOCKET_FIRST, HTTP_SOCKETS) \
+		|| SOCKETS_OVERLAP(DMXUDP_SOCKET, 1, HTTP_SOCKET_FIRST, HTTP_SOCKETS) \
+		|| SOCKETS_OVERLAP(DMXUDP_SOCKET, 1, SACN_SOCKET, SACN_UNIVERSES) \
+		|| (MACRAW_ENABLE && (SOCKETS_OVERLAP(MACRAW_SOCKET, 1, HTTP_SOCKET_FIRST, HTTP_SOCKETS) \
+				|| SOCKETS_OVERLAP(MACRAW_SOCKET, 1, SACN_SOCKET, SACN_UNIVERSES) \
+				|| MACRAW_SOCKET == DMXUDP_SOCKET))
+#error "HTTP, sACN, DMX-UDP or MACRAW sockets overlap"
+#endif
 //
 #define WINDOWFULL_FLAG_ON 		1
 #define WINDOWFULL_FLAG_OFF 	0
@@ -78,47 +78,29 @@ char *dhcp_strerror(int errno)
 	return (char *)dhcplib_errno_descriptions[errno-1];
 }
 
-// Helper; rewind "piecemeal" buffer cache and flush a custom # of bytes to advance past current packet.
-void dhcp_helper_flush_packet(uint8_t sockfd, uint16_t udp_pkt_len)
-{
-	refreshRXBufferCache(sockfd);
-	flushRXBufferPiecemeal(sockfd, 8+udp_pkt_len);  // 8 bytes account for the initial UDP preamble (IP+srcport+pktlen) information.
-	setSn_IR(sockfd, Sn_IR_RECV);
-	setSn_CR(sockfd, Sn_CR_RECV);
-	while (getSn_CR(sockfd))
-		;
-	refreshRXBufferCache(sockfd);
-}
+// DHCP client->server request, HTYPE, HLEN, HOPS, then the transaction ID
+static const uint8_t _dhcp_preamble[8] = { 0x01, 0x01, 0x06, 0x00, DHCP_XID_0, DHCP_XID_1, DHCP_XID_2, DHCP_XID_3 };
+static const uint8_t _dhcp_magic_cookie[4] = { DHCP_MAGIC_COOKIE_0, DHCP_MAGIC_COOKIE_1, DHCP_MAGIC_COOKIE_2, DHCP_MAGIC_COOKIE_3 };
 
-// Write initial DHCP information
-int dhcp_write_header(uint8_t sockfd, uint8_t *scratch, uint8_t *ciaddr, uint8_t *yiaddr, uint8_t *siaddr, uint8_t *giaddr, uint8_t *chaddr)
+// Write initial DHCP information; the whole header goes out in one SPI frame with a single TX_WR update.
+int dhcp_write_header(uint8_t sockfd, uint8_t *ciaddr, uint8_t *yiaddr, uint8_t *siaddr, uint8_t *giaddr, uint8_t *chaddr)
 {
-	scratch[0] = 0x01;  // DHCP client->server request
-	scratch[1] = 0x01;  // HTYPE
-	scratch[2] = 0x06;  // HLEN
-	scratch[3] = 0x00;  // HOPS
-	writeToTXBufferPiecemeal(sockfd, scratch, 4);
-	scratch[0] = DHCP_XID_0;
-	scratch[1] = DHCP_XID_1;
-	scratch[2] = DHCP_XID_2;
-	scratch[3] = DHCP_XID_3;
-	writeToTXBufferPiecemeal(sockfd, scratch, 4);
-	fillTXBufferPiecemeal(sockfd, 0x00, 4);  // SECS, FLAGS (0x0000 for each)
-
-	writeToTXBufferPiecemeal(sockfd, ciaddr, 4);
-	writeToTXBufferPiecemeal(sockfd, yiaddr, 4);
-	writeToTXBufferPiecemeal(sockfd, siaddr, 4);
-	writeToTXBufferPiecemeal(sockfd, giaddr, 4);
-	writeToTXBufferPiecemeal(sockfd, chaddr, 6);
-
-	fillTXBufferPiecemeal(sockfd, 0x00, 192+10);
-
-	// Magic Cookie
-	scratch[0] = DHCP_MAGIC_COOKIE_0;
-	scratch[1] = DHCP_MAGIC_COOKIE_1;
-	scratch[2] = DHCP_MAGIC_COOKIE_2;
-	scratch[3] = DHCP_MAGIC_COOKIE_3;
-	writeToTXBufferPiecemeal(sockfd, scratch, 4);
+	SPIVector header[9];
+
+	header[0].array = _dhcp_preamble;      header[0].length = 8;
+	header[1].array = NULL;                header[1].length = 4;  // SECS, FLAGS (0x0000 for each)
+	header[1].value = 0x00;
+	header[2].array = ciaddr;              header[2].length = 4;
+	header[3].array = yiaddr;              header[3].length = 4;
+	header[4].array = siaddr;              header[4].length = 4;
+	header[5].array = giaddr;              header[5].length = 4;
+	header[6].array = chaddr;              header[6].length = 6;
+	header[7].array = NULL;                header[7].length = 192+10;
+	header[7].value = 0x00;
+	header[8].array = _dhcp_magic_cookie;  header[8].length = 4;
+
+	if (!writeToTXBufferVector(sockfd, header, 9))
+		return -1;
 
 	return 0;
 }
@@ -166,14 +148,16 @@ int dhcp_read_header(uint8_t sockfd, uint8_t *scratch, uint8_t *ciaddr, uint8_t
 int dhcp_write_option(uint8_t sockfd, uint8_t option, uint8_t len, void *buf)
 {
 	uint8_t opthdr[2];
+	SPIVector option_vector[2];
 
 	opthdr[0] = option;
 	opthdr[1] = len;
-	if (getTXVirtualFreeSize(sockfd) < 2+len)
+	option_vector[0].array = opthdr;
+	option_vector[0].length = 2;
+	option_vector[1].array = buf;
+	option_vector[1].length = len;
+	if (!writeToTXBufferVector(sockfd, option_vector, 2))
 		return -1;
-
-	writeToTXBufferPiecemeal(sockfd, opthdr, 2);
-	writeToTXBufferPiecemeal(sockfd, buf, len);
 	
 	return 0;
 }
@@ -222,12 +206,10 @@ int dhcp_send_packet(uint8_t sockfd, uint8_t *scratch, uint8_t dhcp_msgtype)
 	printf("%s: Our MAC = %x:%x:%x:%x:%x:%x\n", funcname, ourmac[0], ourmac[1], ourmac[2], ourmac[3], ourmac[4], ourmac[5]);
 
 
-	// DHCP header
-	if (dhcp_msgtype == DHCP_MSGTYPE_DHCPDISCOVER) {
-		dhcp_write_header(sockfd, scratch, ipzero, ipzero, ipzero, ipzero, ourmac);
-	} else {
-		dhcp_write_header(sockfd, scratch, ipzero, ipzero, siaddr, ipzero, ourmac);
-	}
+	// DHCP header; nothing is written when it doesn't fit, the caller's timeout retries
+	if (dhcp_write_header(sockfd, ipzero, ipzero,
+			dhcp_msgtype == DHCP_MSGTYPE_DHCPDISCOVER ? ipzero : siaddr, ipzero, ourmac) < 0)
+		return -1;
 
 	/* Write options */
 	
@@ -261,7 +243,7 @@ int dhcp_send_packet(uint8_t sockfd, uint8_t *scratch, uint8_t dhcp_msgtype)
 	// Finished
 	dhcp_write_option(sockfd, DHCP_OPTCODE_END, 0, NULL);
 
-	send(sockfd, NULL, (u_int *)scratch, 1);  // Submit SEND command to commit the packet over the wire
+	sendto(sockfd, NULL, 0, ipone, 67);  // Submit SEND command to commit the packet over the wire, broadcast to the server port
 
 	return 0;
 }
@@ -316,6 +298,7 @@ int dhcp_loop_configure(uint8_t *dnsaddr, struct DHCPrenew *lease)
 {
 	uint8_t scratch[34];
 	uint16_t loopcount=0, udp_pkt_len=0;
+	DatagramReader reader;
 	/* ^ loopcount is an overloaded variable:
 	 * +-----------------------------------------------+
 	 * |15 14 13 12 11 10  9  8  7  6  5  4  3  2  1  0|
@@ -358,13 +341,9 @@ int dhcp_loop_configure(uint8_t *dnsaddr, struct DHCPrenew *lease)
 		return -1;
 	}
 
-	// Init socket - bind UDP on port 68
+	// Init socket - bind UDP on port 68, server listens on port 67
 	socket(DHCP_SOCKFD, Sn_MR_UDP, 68, 0);
 
-	// UDP destination for outbound packets
-	setSn_DPORT(DHCP_SOCKFD, 67);    // Server listens on port 67, client listens on port 68
-	setSn_DIPR(DHCP_SOCKFD, ipone);  // Dest IP = 255.255.255.255 (UDP broadcast)
-
 	if (lease != NULL && lease->do_renew) {
 		// DHCP renewal only requires a DHCPREQUEST + DHCPACK, so pre-set the 'state'
 		loopcount = 2 << 11;
@@ -398,19 +377,18 @@ int dhcp_loop_configure(uint8_t *dnsaddr, struct DHCPrenew *lease)
 				}
 				#endif
 
-				if (getRXReceived(DHCP_SOCKFD)) {
+				openDatagrams(&reader, DHCP_SOCKFD);
+				if (nextDatagram(&reader)) {
 					printf("%s: Packet received\n", funcname);
 
-					// Read UDP preamble
-					flushRXBufferPiecemeal(DHCP_SOCKFD, 4);  // Src IP; don't care
-					readFromRXBufferPiecemeal(DHCP_SOCKFD, scratch, 4);  // Src Port & UDP Packet Length
-					udp_pkt_len = ntohs(scratch+2);
-					printf("%s: SrcPort = %d, PktLen = %d, RXrecv = %d\n", funcname, ntohs(scratch), udp_pkt_len, getRXReceived(DHCP_SOCKFD));
+					// UDP preamble already parsed by the reader; Src IP is don't care
+					udp_pkt_len = reader.length;
+					printf("%s: SrcPort = %d, PktLen = %d, RXrecv = %d\n", funcname, reader.port, udp_pkt_len, reader.remaining);
 
-					if (ntohs(scratch) != 67) {
+					if (reader.port != 67) {
 						dhcplib_errno = DHCP_ERRNO_DHCPOFFER_SRCPORT_INVALID;
-						dhcp_helper_flush_packet(DHCP_SOCKFD, udp_pkt_len);
-						printf("%s: %s (found %u)\n", funcname, dhcplib_errno_descriptions[dhcplib_errno-1], ntohs(scratch));
+						commitDatagrams(&reader);
+						printf("%s: %s (found %u)\n", funcname, dhcplib_errno_descriptions[dhcplib_errno-1], reader.port);
 						continue;
 					}
 
@@ -474,15 +452,16 @@ int dhcp_loop_configure(uint8_t *dnsaddr, struct DHCPrenew *lease)
 
 							}
 						} while (*optcode != DHCP_OPTCODE_END);
-						dhcp_helper_flush_packet(DHCP_SOCKFD, udp_pkt_len);  // Flush remainder of packet
+						commitDatagrams(&reader);  // Flush remainder of packet
 						loopcount = (loopcount & 0x87FF) | (2 << 11);
 						dhcplib_errno = 0;  // Reset dhcplib_errno in case it was set by a prior erroneous packet
 					} else {
 						// Not a DHCPOFFER; flush packet and signal more may come, then loop around.
-						dhcp_helper_flush_packet(DHCP_SOCKFD, udp_pkt_len);  // Flush remainder of packet
+						commitDatagrams(&reader);  // Flush remainder of packet
 						printf("%s: Packet is not DHCPOFFER; MSGTYPE=%d\n", funcname, ret);
 					}
 				}
+				commitDatagrams(&reader);  // No-op unless a malformed datagram was skipped
 				break;  // If there is no data waiting, loop will just continue another round.
 
 			case 2:  // Send DHCPREQUEST (officially requesting the lease)
@@ -501,19 +480,18 @@ int dhcp_loop_configure(uint8_t *dnsaddr, struct DHCPrenew *lease)
 				}
 				#endif
 
-				if (getRXReceived(DHCP_SOCKFD)) {
+				openDatagrams(&reader, DHCP_SOCKFD);
+				if (nextDatagram(&reader)) {
 					printf("%s: Packet received\n", funcname);
 
-					// Read UDP preamble
-					flushRXBufferPiecemeal(DHCP_SOCKFD, 4);  // Src IP; don't care
-					readFromRXBufferPiecemeal(DHCP_SOCKFD, scratch, 4);  // Src Port & UDP Packet Length
-					udp_pkt_len = ntohs(scratch+2);
-					printf("%s: SrcPort = %d, PktLen = %d, RXrecv = %d\n", funcname, ntohs(scratch), udp_pkt_len, getRXReceived(DHCP_SOCKFD));
+					// UDP preamble already parsed by the reader; Src IP is don't care
+					udp_pkt_len = reader.length;
+					printf("%s: SrcPort = %d, PktLen = %d, RXrecv = %d\n", funcname, reader.port, udp_pkt_len, reader.remaining);
 
-					if (ntohs(scratch) != 67) {
+					if (reader.port != 67) {
 						dhcplib_errno = DHCP_ERRNO_DHCPACK_SRCPORT_INVALID;
-						dhcp_helper_flush_packet(DHCP_SOCKFD, udp_pkt_len);  // Flush remainder of packet
-						printf("%s: %s (found %u)\n", funcname, dhcplib_errno_descriptions[dhcplib_errno-1], ntohs(scratch));
+						commitDatagrams(&reader);  // Flush remainder of packet
+						printf("%s: %s (found %u)\n", funcname, dhcplib_errno_descriptions[dhcplib_errno-1], reader.port);
 						continue;
 					}
 
@@ -538,7 +516,7 @@ int dhcp_loop_configure(uint8_t *dnsaddr, struct DHCPrenew *lease)
 									}
 							}
 						} while (*optcode != DHCP_OPTCODE_END);
-						dhcp_helper_flush_packet(DHCP_SOCKFD, udp_pkt_len);  // Flush remainder of packet
+						commitDatagrams(&reader);  // Flush remainder of packet
 
 						printf("%s: DHCPACK contents processed; validating\n", funcname);
 						if (memcmp(siaddr, siaddr_ack, 4)) {
@@ -569,10 +547,11 @@ int dhcp_loop_configure(uint8_t *dnsaddr, struct DHCPrenew *lease)
 						break;
 					} else {
 						// Not a DHCPACK; flush packet and signal more may come, then loop around.
-						dhcp_helper_flush_packet(DHCP_SOCKFD, udp_pkt_len);  // Flush remainder of packet
+						commitDatagrams(&reader);  // Flush remainder of packet
 						printf("%s: Packet is not DHCPACK; MSGTYPE=%u\n", funcname, scratch[0]);
 					}
 				}
+				commitDatagrams(&reader);  // No-op unless a malformed datagram was skipped
 				break;  // If there is no data waiting, loop will just continue another round.
 		}
 		_delay_cycles(500000);  // 1/100sec at 25MHz (1/64sec at 16MHz)
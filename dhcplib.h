@@ -32,7 +32,7 @@
 
 /* User-tunable options. */
 #define DHCP_LOOP_COUNT_TIMEOUT 500
-#define DHCP_SOCKFD 7
+#define DHCP_SOCKFD SOCK_DHCP
 
 // Transaction ID; may be changed if necessary, different devices should have unique XIDs.
 #define DHCP_XID_0 0x39
@@ -255,7 +255,7 @@ struct DHCPrenew {
 };
 
 /* Functions */
-int dhcp_write_header(uint8_t, uint8_t *, uint8_t *, uint8_t *, uint8_t *, uint8_t *, uint8_t *);
+int dhcp_write_header(uint8_t, uint8_t *, uint8_t *, uint8_t *, uint8_t *, uint8_t *);
 int dhcp_read_header(uint8_t, uint8_t *, uint8_t *, uint8_t *, uint8_t *, uint8_t *, uint8_t *);
 int dhcp_write_option(uint8_t, uint8_t, uint8_t, void *);
 int dhcp_read_option(uint8_t, uint8_t *, uint8_t *, uint8_t, void *);
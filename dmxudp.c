@@ -0,0 +1,122 @@
+/*
+ * dmxudp.c
+ *
+ * Binary DMX protocol on its own UDP socket, see dmxudp.h for the format.
+ * All queued messages are walked with one RECV. Headers are read into RAM,
+ * levels go from the RX ring straight into the store and replies are
+ * written into TX memory as a vector, header and store slice, without a
+ * staging buffer.
+ */
+
+#include <string.h>
+#include "defines.h"
+#include "w5500.h"
+#include "wizevent.h"
+#include "msp430server.h"
+#include "dmxudp.h"
+
+DMXUDPStats dmxUDPStats;
+
+void startDMXUDP(void) {
+	setSocketEventHandler(DMXUDP_SOCKET, Sn_IR_RECV, 0);
+	socket(DMXUDP_SOCKET, Sn_MR_UDP, DMXUDP_PORT, 0);
+}
+
+/*
+ * Answer the sender with the request header retyped and payload behind it
+ */
+static void reply(DatagramReader *reader, u_char *header, u_char type,
+		const u_char *payload, u_int length) {
+	SPIVector message[2];
+
+	header[1] = type;
+	message[0].array = header;		message[0].length = DMXUDP_HEADER_SIZE;
+	message[1].array = payload;		message[1].length = length;
+	if (writeToTXBufferVector(DMXUDP_SOCKET, message, 2)) {
+		sendto(DMXUDP_SOCKET, 0, 0, reader->addr, reader->port);
+	}
+}
+
+/*
+ * Expand runs from the ring into levels, stops at count. Levels before a
+ * malformed run are already written.
+ */
+static u_char writeRLE(DatagramReader *reader, u_char *levels, u_int count) {
+	u_char control, value;
+	u_int run, done = 0;
+
+	while (done < count) {
+		if (!readDatagram(reader, &control, 1))
+			return DMXUDP_BAD_LENGTH;
+		if (control < 0x80) {
+			run = control + 1;
+			if (run > count - done || readDatagram(reader, levels + done, run) != run)
+				return DMXUDP_BAD_LENGTH;
+		} else {
+			run = control - 0x7E;
+			if (run > count - done || !readDatagram(reader, &value, 1))
+				return DMXUDP_BAD_LENGTH;
+			memset(levels + done, value, run);
+		}
+		done += run;
+	}
+	return DMXUDP_OK;
+}
+
+static u_char writeRange(DatagramReader *reader, const u_char *header,
+		u_char *levels, u_int count) {
+	if (header[5] & DMXUDP_FLAG_RLE)
+		return writeRLE(reader, levels, count);
+	// raw levels, nothing is written unless all of them are there
+	if (reader->length - DMXUDP_HEADER_SIZE != count)
+		return DMXUDP_BAD_LENGTH;
+	readDatagram(reader, levels, count);
+	return DMXUDP_OK;
+}
+
+/*
+ * Drain everything queued on the socket, returns 1 if anything was
+ */
+u_char serviceDMXUDP(void) {
+	DatagramReader reader;
+	u_char header[DMXUDP_HEADER_SIZE];
+	u_char status;
+	u_int start, count;
+
+	if (!takeSocketEvents(DMXUDP_SOCKET, Sn_IR_RECV))
+		return 0;
+	openDatagrams(&reader, DMXUDP_SOCKET);
+	while (nextDatagram(&reader)) {
+		if (readDatagram(&reader, header, DMXUDP_HEADER_SIZE) != DMXUDP_HEADER_SIZE
+				|| header[0] != DMXUDP_MAGIC || (header[1] & 0x80)) {
+			// replies are never answered, two nodes can't start an error loop
+			dmxUDPStats.ignored++;
+			continue;
+		}
+		start = ntohs(header + 6);
+		count = ntohs(header + 8);
+		if (header[4] >= DMX_UNIVERSES || start > DMX_CHANNELS
+				|| count > DMX_CHANNELS - start) {
+			status = DMXUDP_BAD_RANGE;
+		} else if (header[1] == DMXUDP_WRITE) {
+			status = writeRange(&reader, header, &dmx[header[4]][start], count);
+			if (status == DMXUDP_OK) {
+				dmxUDPStats.writes++;
+				if (header[5] & DMXUDP_FLAG_ACK) {
+					reply(&reader, header, DMXUDP_ACK, &status, 1);
+				}
+				continue;
+			}
+		} else if (header[1] == DMXUDP_READ) {
+			reply(&reader, header, DMXUDP_DATA, &dmx[header[4]][start], count);
+			dmxUDPStats.reads++;
+			continue;
+		} else {
+			status = DMXUDP_BAD_TYPE;
+		}
+		dmxUDPStats.errors++;
+		reply(&reader, header, DMXUDP_ACK, &status, 1);
+	}
+	commitDatagrams(&reader);
+	return 1;
+}
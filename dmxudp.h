@@ -0,0 +1,56 @@
+/*
+ * dmxudp.h
+ *
+ * Compact binary DMX protocol over UDP. Every message starts with a
+ * 10 byte header, multi-byte fields big endian:
+ *
+ *	0	magic			DMXUDP_MAGIC
+ *	1	type			WRITE, READ, ACK or DATA
+ *	2	sequence		echoed in the ACK/DATA reply
+ *	4	universe
+ *	5	flags			DMXUDP_FLAG_*
+ *	6	start			first channel, 0 based
+ *	8	count			channels
+ *
+ * WRITE carries count raw levels, or with DMXUDP_FLAG_RLE runs of
+ * control bytes: 0x00-0x7F are followed by control + 1 literal levels,
+ * 0x80-0xFF by one level repeated control - 0x7E times (2..129).
+ * READ has no payload and is answered by DATA with count raw levels.
+ * ACK echoes the header and adds a status byte; it answers a WRITE that
+ * asked for it and any request that failed.
+ */
+
+#ifndef DMXUDP_H_
+#define DMXUDP_H_
+
+#include "typedefs.h"
+
+#define DMXUDP_MAGIC			0xD5
+#define DMXUDP_HEADER_SIZE		10
+
+#define DMXUDP_WRITE			0x01
+#define DMXUDP_READ				0x02
+#define DMXUDP_ACK				0x81
+#define DMXUDP_DATA				0x82
+
+#define DMXUDP_FLAG_RLE			0x01	// WRITE payload is run-length encoded
+#define DMXUDP_FLAG_ACK			0x02	// answer a successful WRITE too
+
+#define DMXUDP_OK				0x00
+#define DMXUDP_BAD_RANGE		0x01	// universe or channels outside the store
+#define DMXUDP_BAD_LENGTH		0x02	// payload doesn't hold count levels
+#define DMXUDP_BAD_TYPE			0x03
+
+typedef struct {
+	u_long writes;
+	u_long reads;
+	u_long errors;
+	u_long ignored;			// no magic, too short for a header, or a reply
+} DMXUDPStats;
+
+extern DMXUDPStats dmxUDPStats;
+
+void startDMXUDP(void);
+u_char serviceDMXUDP(void);
+
+#endif /* DMXUDP_H_ */
@@ -0,0 +1,105 @@
+/*
+ * macraw.c
+ *
+ * MACRAW socket, frames bypass the chip's IP/UDP/TCP engine. Every frame
+ * queued since the last pass is walked with one RECV. The 14 byte Ethernet
+ * header is read first and checked against the filter, only accepted frames
+ * have their payload read, up to MACRAW_FRAME_SIZE.
+ *
+ * Latency is counted from the INTn edge to the handler call, the same point
+ * Art-Net records when ArtDmx data lands in the store, so reportFrameLatency
+ * and reportArtNetLatency compare the two firmware paths. Time spent in the
+ * chip before INTn is the same for both and isn't visible here.
+ */
+
+#include "defines.h"
+#include "w5500.h"
+#include "wizevent.h"
+#include "macraw.h"
+
+MACRAWStats macrawStats;
+
+static FrameFilter _filter;
+static FrameHandler _handler;
+static u_char _frame[MACRAW_FRAME_SIZE];
+
+void startMACRAW(const FrameFilter *filter, FrameHandler handler) {
+	_filter = *filter;
+	_handler = handler;
+	setSocketEventHandler(MACRAW_SOCKET, Sn_IR_RECV, 0);
+	socket(MACRAW_SOCKET, Sn_MR_MACRAW, 0, filter->mode);
+}
+
+static u_char acceptFrame(const u_char *header) {
+	u_char c;
+
+	if (_filter.etherType != ETHERTYPE_ANY
+			&& ntohs((u_char *) header + 12) != _filter.etherType)
+		return 0;
+	if (_filter.matchDestination) {
+		for (c = 0; c < 6; c++) {
+			if (header[c] != _filter.destination[c])
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Drain every queued frame, returns 1 if RECV was signalled
+ */
+u_char serviceMACRAW(void) {
+	DatagramReader reader;
+	u_int length;
+
+	if (!takeSocketEvents(MACRAW_SOCKET, Sn_IR_RECV))
+		return 0;
+	openDatagrams(&reader, MACRAW_SOCKET);
+	while (nextFrame(&reader)) {
+		if (readDatagram(&reader, _frame, ETHER_HEADER_SIZE) != ETHER_HEADER_SIZE
+				|| !acceptFrame(_frame)) {
+			macrawStats.filtered++;
+			continue;
+		}
+		length = ETHER_HEADER_SIZE + readDatagram(&reader, _frame + ETHER_HEADER_SIZE,
+				MACRAW_FRAME_SIZE - ETHER_HEADER_SIZE);
+		if (length < reader.length) {
+			macrawStats.truncated++;
+		}
+		recordEventLatency(&macrawStats.latency);
+		macrawStats.frames++;
+		if (_handler) {
+			_handler(_frame, length, reader.length);
+		}
+	}
+	commitDatagrams(&reader);
+	return 1;
+}
+
+/*
+ * Build the header around payload in TX memory and send, short frames are padded
+ */
+u_char sendEtherFrame(const u_char *destination, u_int etherType,
+		const u_char *payload, u_int length) {
+	u_char source[6], type[2];
+	SPIVector frame[5];
+
+	getSHAR(source);
+	htons(etherType, type);
+	frame[0].array = destination;	frame[0].length = 6;
+	frame[1].array = source;		frame[1].length = 6;
+	frame[2].array = type;			frame[2].length = 2;
+	frame[3].array = payload;		frame[3].length = length;
+	frame[4].array = 0;				frame[4].value = 0;
+	frame[4].length = ETHER_HEADER_SIZE + length < ETHER_MIN_FRAME
+			? ETHER_MIN_FRAME - ETHER_HEADER_SIZE - length : 0;
+
+	if (!writeToTXBufferVector(MACRAW_SOCKET, frame, 5)) {
+		return 2;
+	}
+	return sendFrame(MACRAW_SOCKET, 0, 0);
+}
+
+void reportFrameLatency(void) {
+	reportEventLatency("MACRAW", &macrawStats.latency);
+}
@@ -0,0 +1,42 @@
+/*
+ * macraw.h
+ *
+ * Raw Ethernet frames on socket 0, filtered on EtherType and destination MAC
+ */
+
+#ifndef MACRAW_H_
+#define MACRAW_H_
+
+#include "typedefs.h"
+#include "wizevent.h"
+
+#define ETHER_HEADER_SIZE		14		// destination, source, EtherType
+#define ETHER_MIN_FRAME			60		// without FCS, shorter frames are padded
+#define ETHERTYPE_ANY			0x0000
+
+typedef struct {
+	u_char mode;			// chip side filter: Sn_MR_MFEN, Sn_MR_MMB, Sn_MR_MIP6B, 0 to capture everything
+	u_int etherType;		// ETHERTYPE_ANY to accept every type
+	u_char matchDestination;	// compare destination below
+	u_char destination[6];
+} FrameFilter;
+
+// frame holds the first length bytes, frameLength is what was on the wire
+typedef void (*FrameHandler)(const u_char *frame, u_int length, u_int frameLength);
+
+typedef struct {
+	u_long frames;			// handed to the handler
+	u_long filtered;		// dropped by the filter
+	u_long truncated;		// longer than MACRAW_FRAME_SIZE
+	EventLatency latency;	// INTn to handler
+} MACRAWStats;
+
+extern MACRAWStats macrawStats;
+
+void startMACRAW(const FrameFilter *filter, FrameHandler handler);
+u_char serviceMACRAW(void);
+u_char sendEtherFrame(const u_char *destination, u_int etherType,
+		const u_char *payload, u_int length);
+void reportFrameLatency(void);
+
+#endif /* MACRAW_H_ */
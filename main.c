@@ -3,7 +3,13 @@
 #include "w5500.h"
 #include "msp430server.h"
 #include "dhcplib.h"
+#include "wizevent.h"
+#include "tick.h"
 #include "wizdebug.h"
+#include "artnet.h"
+#include "sacn.h"
+#include "macraw.h"
+#include "dmxudp.h"
 #include <stdio.h>
 #include "driverlib.h"
 
@@ -23,6 +29,10 @@ const u_char subnetMask[4] = { 255, 255, 255, 0 }; // subnet mask
 // network configuration for client mode
 const u_char destinationIP[4] = { 192, 168, 1, 3 }; // destination IP
 const u_int destinationPort = 80; // destination port
+#if MACRAW_ENABLE
+// raw frames: local experimental EtherType, own MAC or broadcast (chip filter)
+const FrameFilter frameFilter = { Sn_MR_MFEN, 0x88B5, 0, { 0 } };
+#endif
 
 /*
  * main.c
@@ -51,6 +61,11 @@ int main(void) {
 	//wiznet_debug_printf("Beginning:\n");
 	printf("Beginning:\n");
 	configureMSP430();
+	MAP_Interrupt_enableMaster(); // SPI queue is interrupt driven
+	printf("SPI clock: %lu Hz\n", calibrateSPIClock());
+#if DEBUG_REPORTS
+	reportSPICycles();
+#endif
 	//resetW5500();
 	configureW5500(sourceIP, gatewayIP, subnetMask);
 
@@ -91,6 +106,13 @@ int main(void) {
 		printf("dhcp_loop_configure returned error: %s\n", dhcp_strerror(dhcplib_errno));
 */
 
+	startHTTPServer(80);
+	startArtNet();
+	startSACN();
+	startDMXUDP();
+#if MACRAW_ENABLE
+	startMACRAW(&frameFilter, 0);
+#endif
 	while (1) {
 		runAsServer();
 		//runAsClient();
@@ -98,26 +120,31 @@ int main(void) {
 }
 
 void runAsServer() {
-	//while (1) {
-	startServer(0, 80);
-	// wait for connection
-	// TODO in the future, we will put MCU to sleep and use interrupt to wake it up
-	waitForConnection(0);
-	// connection was established, now wait for data
-	waitForData(0);
-	// we've got data, process it
-	Request request = { 0, 0, 0, 0 };
-	if (parseRequest(&request)) {
-		// request is OK, process request
-		addHTTP200ResponseToBuffer();
-		processRequest(&request);
-	} else {
-		// cannot parse request
-		addHTTP400ResponseToBuffer();
+	u_char busy;
+#if DEBUG_REPORTS
+	static u_long lastReport;
+
+	if (tickElapsed(lastReport, DEBUG_REPORT_INTERVAL)) {
+		lastReport = getTick();
+		reportHTTPStats();
+		reportArtNetLatency();
+#if MACRAW_ENABLE
+		reportFrameLatency();
+#endif
 	}
-	// flush buffer, disconnect, & close
-	stopServer(0);
-	//}
+#endif
+
+	// event loop pass: dispatch INTn, advance every HTTP connection, drain the DMX sockets, sleep when nothing is in flight
+	serviceSocketEvents();
+	busy = serviceHTTPServer();
+	serviceArtNet();
+	serviceSACN();
+	serviceDMXUDP();
+#if MACRAW_ENABLE
+	serviceMACRAW();
+#endif
+	if (!busy)
+		sleepUntilSocketEvent();
 }
 
 void runAsClient() {
@@ -2,6 +2,9 @@
 #include "defines.h"
 #include "msp430server.h"
 #include "w5500.h"
+#include "wizspi.h"
+#include "wizevent.h"
+#include "tick.h"
 #include "tags.h"
 #include "driverlib.h"
 #include <stdio.h>
@@ -23,17 +26,14 @@ const u_char MAC[6] = { 0x00, 0x08, 0xDC, 0x05, 0xB4, 0x38 }; // WIZnet's base a
 ///////////////////////////////////////////////////////////////
 
 u_char ch_status[MAX_SOCK_NUM]; /** 0:closed, 1:ready, 2:connected */
-u_char txBuffer[TX_MAX_BUF_SIZE]; // TX Buffer for applications
-u_char rxBuffer[RX_MAX_BUF_SIZE]; // RX Buffer for applications
 
-u_char lastByte = 0;
-u_char readBufferPointer = 0;
-u_char writeBufferPointer = 0;
-u_int bytesReceived = 0;
+// per-connection parse/response state, the buffer functions work on the selected one
+Connection connections[HTTP_SOCKETS];
+Connection *connection = &connections[0];
 
-u_char dmx[2][64];
+u_char dmx[DMX_UNIVERSES][DMX_CHANNELS];
 u_char universe = 0;
-u_char channel = 0;
+u_int channel = 0;
 
 ///////////////////////////////////////////////////////
 // Response section
@@ -58,14 +58,51 @@ void closeDocument(u_char success) {
 /////////////////////////////////////////////////////////
 // HTTP response headers
 /////////////////////////////////////////////////////////
-void addHTTP400ResponseToBuffer() {
-	addStringToBuffer(sRESPONSE_STATUS_BAD_REQ);
+/*
+ * Status line plus Content-Length and Connection headers, contentLength counts everything after the blank line.
+ * Returns 0 when the headers couldn't be written.
+ */
+static u_char addHTTPResponseToBuffer(const u_char *status, u_int statusLength,
+		u_int contentLength, u_char keepAlive) {
+	SPIVector header[8];
+	u_char digits[5];
+	u_char i = sizeof(digits);
+
+	do {
+		digits[--i] = '0' + contentLength % 10;
+		contentLength /= 10;
+	} while (contentLength && i);
+
+	header[1].array = status;
+	header[1].length = statusLength;
+	header[2].array = sRESPONSE_CONTENT_TYPE_XML;
+	header[2].length = sizeof(sRESPONSE_CONTENT_TYPE_XML) - 1;
+	header[3].array = sRESPONSE_CONTENT_LENGTH;
+	header[3].length = sizeof(sRESPONSE_CONTENT_LENGTH) - 1;
+	header[4].array = digits + i;
+	header[4].length = sizeof(digits) - i;
+	header[5].array = sNEW_LINE;
+	header[5].length = sizeof(sNEW_LINE) - 1;
+	if (keepAlive) {
+		header[6].array = sRESPONSE_CONNECTION_KEEP_ALIVE;
+		header[6].length = sizeof(sRESPONSE_CONNECTION_KEEP_ALIVE) - 1;
+	} else {
+		header[6].array = sRESPONSE_CONNECTION_CLOSE;
+		header[6].length = sizeof(sRESPONSE_CONNECTION_CLOSE) - 1;
+	}
+	header[7].array = sNEW_LINE;
+	header[7].length = sizeof(sNEW_LINE) - 1;
+	return addVectorToBuffer(header, 8);
 }
 
-void addHTTP200ResponseToBuffer() {
-	addStringToBuffer(sRESPONSE_STATUS_OK);
-	addStringToBuffer(sRESPONSE_CONTENT_TYPE_XML);
-	addStringToBuffer(sNEW_LINE);
+u_char addHTTP400ResponseToBuffer(u_int contentLength, u_char keepAlive) {
+	return addHTTPResponseToBuffer(sRESPONSE_STATUS_BAD_REQ,
+			sizeof(sRESPONSE_STATUS_BAD_REQ) - 1, contentLength, keepAlive);
+}
+
+u_char addHTTP200ResponseToBuffer(u_int contentLength, u_char keepAlive) {
+	return addHTTPResponseToBuffer(sRESPONSE_STATUS_OK,
+			sizeof(sRESPONSE_STATUS_OK) - 1, contentLength, keepAlive);
 }
 
 //////////////////////////////////////////////////
@@ -98,7 +135,7 @@ void processRequest(Request *request) {
 ////////////////////////////////////////////////////////////
 // Parse request
 ////////////////////////////////////////////////////////////
-u_char parseRequest(Request *request) {
+WIZ_RAMFUNC u_char parseRequest(Request *request) {
 
 	u_char done = 0;
 	u_char byte = 0;
@@ -173,7 +210,7 @@ u_char parseRequest(Request *request) {
 						dmx[universe][channel] = param_value;
 						channel++;
 					}
-					if (channel == 64) // reached max, ignore the rest
+					if (channel >= DMX_CHANNELS) // reached max, ignore the rest
 						done = 1;
 				}
 
@@ -203,7 +240,7 @@ u_char parseRequest(Request *request) {
 
 				switch (property) { // assign value
 				case REQ_UNIVERSE:
-					universe = param_value;
+					universe = param_value < DMX_UNIVERSES ? param_value : 0;
 					break;
 				case REQ_CHANNEL:
 					channel = param_value;
@@ -240,6 +277,12 @@ void sendRequest() {
 //////////////////////////////////////////////
 //
 //////////////////////////////////////////////
+// KB per socket: HTTP 0-2, UDP 3-6, DHCP 7 (SOCK_DHCP)
+const MemoryProfile memoryProfile = {
+	{ 4, 4, 2, 2, 1, 1, 1, 1 },	// TX
+	{ 2, 2, 2, 4, 2, 2, 1, 1 }	// RX
+};
+
 void configureW5500(const u_char *sourceIP, const u_char *gatewayIP,
 		const u_char *subnetMask) {
 
@@ -252,6 +295,10 @@ void configureW5500(const u_char *sourceIP, const u_char *gatewayIP,
 	setRTR(6000);
 	setRCR(3);
 
+	if (!applyMemoryProfile(&memoryProfile)) {
+		printf("Invalid socket memory profile\n");
+	}
+	configureSocketEvents();
 }
 
 void configureMSP430() {
@@ -285,6 +332,7 @@ void configureMSP430() {
 	    MAP_GPIO_setAsOutputPin(ETH_CS_PORT,
 	                        ETH_CS_PIN);
 
+	    // in WIZ_SPI_FDM mode SCSn stays low from here on
 	    MAP_GPIO_setOutputLowOnPin(ETH_CS_PORT,
 	                           ETH_CS_PIN);
 	    //
@@ -296,7 +344,7 @@ void configureMSP430() {
 	    {
 	        EUSCI_A_SPI_CLOCKSOURCE_SMCLK,                      		// SMCLK Clock Source
 	        MAP_CS_getSMCLK(),                                  			// Get SMCLK frequency
-	        8000000,                                                	// SPICLK = 20 MHz
+	        SPI_CLOCK_DEFAULT,                                      	// SPICLK until calibrateSPIClock() runs
 	        EUSCI_A_SPI_MSB_FIRST,                             			// MSB First
 			EUSCI_A_SPI_PHASE_DATA_CAPTURED_ONFIRST_CHANGED_ON_NEXT, 	// Phase //  EUSCI_SPI_PHASE_DATA_CHANGED_ONFIRST_CAPTURED_ON_NEXT EUSCI_SPI_PHASE_DATA_CAPTURED_ONFIRST_CHANGED_ON_NEXT
 	        EUSCI_A_SPI_CLOCKPOLARITY_INACTIVITY_LOW,         			// Low polarity
@@ -318,25 +366,125 @@ void configureMSP430() {
 		//UCB0BR0 |= 0x02;
 		SPI_initMaster(ETH_EUSCI_MODULE, &spiMasterConfig);
 	    SPI_enableModule(ETH_EUSCI_MODULE);
+	    configureSPIDMA();
 
-	    SPI_enableInterrupt(ETH_EUSCI_MODULE, ETH_EUSCI_REC_INT);
-	    Interrupt_enableInterrupt(ETH_INT_ENABLE);
+	    // receive interrupt itself is enabled by the SPI queue while a transaction runs
 	    SPI_clearInterruptFlag(ETH_EUSCI_MODULE,  ETH_EUSCI_REC_INT);
+	    Interrupt_enableInterrupt(ETH_INT_ENABLE);
+
+	    configureTick();
 
 
 }
 
+/*
+ * Check VERSIONR and a write/readback pattern in the calibration socket's TX buffer
+ */
+static u_char verifySPIClock(void) {
+	u_char pattern[64];
+	u_char readback[64];
+	u_char control = (SPI_CALIBRATION_SOCKET << 5) | TXBUF_BLOCK;
+	u_char round, i;
+
+	for (round = 0; round < SPI_CALIBRATION_ROUNDS; round++) {
+		if (getVERSIONR() != VERSIONR_W5500)
+			return 0;
+		// alternating bits plus a walking pattern, shifted every round
+		for (i = 0; i < sizeof(pattern); i++) {
+			pattern[i] = (i & 1 ? 0xAA : 0x55) ^ (u_char) (i * 37 + round);
+		}
+		writeMemoryArray(round * sizeof(pattern), control, pattern, sizeof(pattern));
+		readMemoryArray(round * sizeof(pattern), control, readback, sizeof(pattern));
+		for (i = 0; i < sizeof(pattern); i++) {
+			if (readback[i] != pattern[i])
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Step the SPI clock up through the SMCLK dividers until a step fails verification,
+ * then settle one step below the fastest one that passed.
+ * Returns the clock in use, 0 if even the slowest step failed (default clock is kept).
+ */
+u_long calibrateSPIClock(void) {
+	static const u_char dividers[] = { 24, 16, 12, 8, 6, 4, 3, 2, 1 };
+	u_long source = MAP_CS_getSMCLK();
+	u_long passed = 0, previous = 0;
+	u_char i;
+
+	for (i = 0; i < sizeof(dividers); i++) {
+		if (source / dividers[i] > SPI_CLOCK_MAX)
+			break;
+		setSPIClock(source / dividers[i]);
+		if (!verifySPIClock())
+			break;
+		previous = passed;
+		passed = source / dividers[i];
+	}
+	if (passed == 0) {
+		setSPIClock(SPI_CLOCK_DEFAULT);
+		return 0;
+	}
+	// safety margin, unless only the slowest step passed
+	if (previous)
+		passed = previous;
+	return setSPIClock(passed);
+}
+
+/*
+ * Print the CPU cycles per byte of the byte (interrupt) and DMA transfer paths
+ * and the cost of a register access, build once with and once without
+ * WIZ_RAM_HOT_PATH to compare flash and SRAM_CODE
+ */
+void reportSPICycles(void) {
+	static const u_int lengths[] = { SPI_DMA_THRESHOLD - 1, 512 };
+	static u_char scratch[512];
+	u_char control = (SPI_CALIBRATION_SOCKET << 5) | TXBUF_BLOCK;
+	u_long start, write, read;
+	u_char i;
+
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		start = DWT->CYCCNT;
+		writeMemoryArray(0, control, scratch, lengths[i]);
+		write = DWT->CYCCNT - start;
+		start = DWT->CYCCNT;
+		readMemoryArray(0, control, scratch, lengths[i]);
+		read = DWT->CYCCNT - start;
+		printf("SPI %u bytes: write %lu, read %lu cycles/byte\n", lengths[i],
+				write / lengths[i], read / lengths[i]);
+	}
+
+	// register access path, compare builds with different WIZ_CS_MODE
+	start = DWT->CYCCNT;
+	for (i = 0; i < 100; i++) {
+		wizSelect();
+		wizDeselect();
+	}
+	write = DWT->CYCCNT - start;
+	start = DWT->CYCCNT;
+	for (i = 0; i < 100; i++) {
+		getSn_SR(SPI_CALIBRATION_SOCKET);
+	}
+	read = DWT->CYCCNT - start;
+	printf("CS select/deselect %lu, Sn_SR read %lu cycles\n", write / 100, read / 100);
+}
+
 void startClient(u_char s, u_char *destinationIP, u_char port) {
 	// make sure socket is closed
 	waitUntilSocketClosed(s);
 	// open socket on arbitrary port
 	openSocketOnPort(s, 0);
+	setSocketEventHandler(s, Sn_IR_CON | Sn_IR_RECV | Sn_IR_DISCON | Sn_IR_TIMEOUT, 0);
 	// connect
 	connect(s, destinationIP, port);
 	// verify connection was established
 	// TODO add timer/counter to prevent endless loop when connection cannot be established
 	while (!isConnected(s))
-		;
+		waitSocketEvents(s, Sn_IR_CON | Sn_IR_DISCON | Sn_IR_TIMEOUT);
 }
 
 void stopClient(u_char s) {
@@ -349,6 +497,7 @@ void startServer(u_char s, u_char port) {
 	waitUntilSocketClosed(s);
 	// open socket on port 80
 	openSocketOnPort(s, 80);
+	setSocketEventHandler(s, Sn_IR_CON | Sn_IR_RECV | Sn_IR_DISCON | Sn_IR_TIMEOUT, 0);
 	// start listening
 	startListening(s);
 }
@@ -363,53 +512,394 @@ void stopServer(u_char s) {
 	close_s(s);
 }
 
-void flushBuffer() {
-	//TODO check return status and length, status should be 1 and length = 0;
-	u_int length = writeBufferPointer & 0x00FF;
-	send(0, txBuffer, &length, 0);
-	writeBufferPointer = 0;
+/*
+ * Multi-socket server: every connection runs its own state machine on
+ * HTTP_SOCKETS sockets from HTTP_SOCKET_FIRST, all listening on the same port. Socket commands
+ * are non-blocking, a request is parsed and answered in one pass once its
+ * data is in the chip.
+ */
+static u_int httpPort;
+static u_char counting;		// addCharToBuffer only counts, see countResponseBody
+static u_int countedLength;
+
+void startHTTPServer(u_int port) {
+	u_char i;
+
+	httpPort = port;
+	for (i = 0; i < HTTP_SOCKETS; i++) {
+		connections[i].socket = HTTP_SOCKET_FIRST + i;
+		connections[i].state = CONN_CLOSED;
+	}
+	// accept latency is timed with the cycle counter
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
 }
 
-void addCharToBuffer(u_char character) {
-	txBuffer[writeBufferPointer++] = character;
-	if (writeBufferPointer == TX_MAX_BUF_SIZE) {
-		//TODO check return status and length, status should be 1 and length = 0;
-		u_int length = writeBufferPointer & 0x00FF;
-		send(0, txBuffer, &length, 0);
-		writeBufferPointer = 0;
-	}
-}
-
-u_char getByteFromBuffer(u_char *byte) {
-	if (lastByte == readBufferPointer) { // first time or last byte was read from the local buffer
-		if (bytesReceived > RX_MAX_BUF_SIZE) { // received more bytes than we can fit into our RX buffer
-			lastByte = RX_MAX_BUF_SIZE;
-			bytesReceived -= RX_MAX_BUF_SIZE;
-		} else {
-			lastByte = bytesReceived; // remaining bytes
+static void setConnectionState(Connection *c, u_char state) {
+	c->state = state;
+	c->since = getTick();
+}
+
+/*
+ * Open the socket again right away, LISTEN follows once OPEN completes
+ */
+static void armConnection(Connection *c) {
+	u_char s = c->socket;
+
+	setSocketEventHandler(s, Sn_IR_CON | Sn_IR_RECV | Sn_IR_DISCON | Sn_IR_TIMEOUT, 0);
+	// chip probes idle peers and raises TIMEOUT when one is gone
+	setSn_KPALVTR(s, KEEP_ALIVE_TIME / 5);
+	c->established = 0;
+	c->firstByte = 0;
+	socketAsync(s, Sn_MR_TCP, httpPort, 0, 0);
+	setConnectionState(c, CONN_OPENING);
+}
+
+/*
+ * Sockets that are listening or on their way there
+ */
+static u_char countListening(void) {
+	u_char i, listening = 0;
+
+	for (i = 0; i < HTTP_SOCKETS; i++) {
+		if (connections[i].state == CONN_LISTENING ? !connections[i].established
+				: connections[i].state != CONN_DISCONNECTING) {
+			listening++;
+		}
+	}
+	return listening;
+}
+
+/*
+ * Keep HTTP_BACKLOG sockets listening: when kept-alive connections hold the
+ * rest, the one idle the longest is let go
+ */
+static u_char keepBacklog(void) {
+	Connection *c, *idlest = 0;
+	u_char i;
+
+	if (countListening() >= HTTP_BACKLOG)
+		return 0;
+	for (i = 0; i < HTTP_SOCKETS; i++) {
+		c = &connections[i];
+		if (c->state == CONN_LISTENING && c->established && c->firstByte
+				&& (!idlest || (long) (c->since - idlest->since) < 0)) {
+			idlest = c;
+		}
+	}
+	if (idlest) {
+		disconnectAsync(idlest->socket, 0);
+		setConnectionState(idlest, CONN_DISCONNECTING);
+	}
+	return idlest != 0;
+}
+
+static void recordAcceptLatency(Connection *c) {
+	u_long us = (DWT->CYCCNT - c->acceptCycle) / (MAP_CS_getMCLK() / 1000000);
+
+	c->firstByte = 1;
+	c->stats.accepted++;
+	c->stats.total += us;
+	if (us > c->stats.max) {
+		c->stats.max = us;
+	}
+}
+
+/*
+ * Accept-to-first-byte latency per socket, as seen by the event loop
+ */
+void reportHTTPStats(void) {
+	AcceptStats *stats;
+	u_char i;
+
+	for (i = 0; i < HTTP_SOCKETS; i++) {
+		stats = &connections[i].stats;
+		printf("HTTP socket %u: %lu accepted, first byte avg %lu us, max %lu us\n",
+				connections[i].socket, stats->accepted,
+				stats->accepted ? stats->total / stats->accepted : 0, stats->max);
+	}
+}
+
+/*
+ * Rest of the request after the URL: HTTP/1.1 defaults to keep-alive,
+ * a Connection header decides either way. Reads up to the blank line,
+ * ended is set once it has been seen.
+ */
+static u_char parseKeepAlive(u_char *ended) {
+	u_char byte, keepAlive = 0, line = 0, column = 0, state = 0;
+	const u_char *prefix;
+
+	while (getByteFromBuffer(&byte)) {
+		if (byte == '\r')
+			continue;
+		if (byte == '\n') {
+			if (column == 0) {
+				*ended = 1;
+				break; // blank line, end of headers
+			}
+			line++;
+			column = 0;
+			state = 0;
+			continue;
+		}
+		if (byte > 0x40 && byte < 0x5B)
+			byte += 0x20; // lower case
+		if (state == 0) { // matching the line's prefix
+			prefix = line == 0 ? sHTTP_1_1 : sHEADER_CONNECTION;
+			if (byte != prefix[column]) {
+				state = 2; // some other line, skip it
+			} else if (prefix[column + 1] == 0) {
+				state = 1;
+				if (line == 0)
+					keepAlive = 1;
+			}
+		} else if (state == 1 && line > 0 && byte != ' ') {
+			keepAlive = byte == 'k'; // keep-alive or close
+			state = 2;
+		}
+		column++;
+	}
+	return keepAlive;
+}
+
+/*
+ * Run the body once without output to get its length for Content-Length
+ */
+static u_int countResponseBody(Request *request) {
+	counting = 1;
+	countedLength = 0;
+	if (request) {
+		processRequest(request);
+	}
+	addStringToBuffer(sNEW_LINE);
+	counting = 0;
+	return countedLength;
+}
+
+/*
+ * Parse and answer one request. Returns 0 to close the connection, 1 when it
+ * stays open, 2 when the request is still arriving: nothing is answered or
+ * released then, it is parsed again from the start with the next segment.
+ * Bytes behind the request stay in the ring.
+ */
+static u_char serveRequest(Connection *c) {
+	Request request = { 0, 0, 0, 0 };
+	u_char keepAlive = 0, ended = 0, headers;
+
+	connection = c;
+	c->writeBufferPointer = 0;
+	c->sendError = 0;
+	openRXCursor(&c->rx, c->socket, c->rxBuffer, RX_MAX_BUF_SIZE);
+	if (parseRequest(&request)) {
+		keepAlive = parseKeepAlive(&ended);
+	}
+	if (!ended && isRXCursorDrained(&c->rx)
+			&& c->rx.consumed < getSocketRXSize(c->socket)) {
+		rewindRXCursor(&c->rx);
+		return 2;
+	}
+	if (ended) {
+		headers = addHTTP200ResponseToBuffer(countResponseBody(&request), keepAlive);
+		if (headers) {
+			processRequest(&request);
+		}
+	} else {
+		// parser lost its place in the stream, or the headers don't fit RX memory, don't reuse the connection
+		keepAlive = 0;
+		headers = addHTTP400ResponseToBuffer(countResponseBody(0), 0);
+	}
+	commitRXCursor(&c->rx);
+	if (!headers) {
+		return 0; // no room in TX memory or the peer is gone, drop the connection
+	}
+	addStringToBuffer(sNEW_LINE);
+	if (flushBuffer() != 1) {
+		return 0; // peer went away mid-response
+	}
+	return keepAlive;
+}
+
+/*
+ * One pass over all connections, returns 1 while a socket command is in flight
+ */
+u_char serviceHTTPServer(void) {
+	Connection *c;
+	u_char i, s, result, events, served, busy = 0;
+
+	for (i = 0; i < HTTP_SOCKETS; i++) {
+		c = &connections[i];
+		s = c->socket;
+		result = pollSocketCommand(s);
+		switch (c->state) {
+		case CONN_CLOSED:
+			armConnection(c);
+			break;
+		case CONN_OPENING:
+			if (result == CMD_DONE) {
+				listenAsync(s, 0);
+				setConnectionState(c, CONN_LISTENING);
+			} else if (result != CMD_ISSUED && result != CMD_WAIT_STATUS) {
+				closeAsync(s, 0);
+				setConnectionState(c, CONN_CLOSING);
+			}
+			break;
+		case CONN_LISTENING:
+			if (result == CMD_FAILED || result == CMD_TIMEOUT) {
+				closeAsync(s, 0);
+				setConnectionState(c, CONN_CLOSING);
+				break;
+			}
+			events = takeSocketEvents(s, Sn_IR_CON | Sn_IR_RECV | Sn_IR_DISCON | Sn_IR_TIMEOUT);
+			if (events & Sn_IR_CON) {
+				c->established = 1;
+				c->acceptCycle = DWT->CYCCNT;
+				c->since = getTick();
+			}
+			if (events & Sn_IR_RECV) {
+				if (!c->firstByte) {
+					if (!c->established) { // CON and data seen together
+						c->acceptCycle = DWT->CYCCNT;
+					}
+					recordAcceptLatency(c);
+				}
+				c->established = 1;
+				// pipelined requests are already in the ring, no further RECV event announces them
+				do {
+					served = serveRequest(c);
+				} while (served == 1 && getRXReceived(s));
+				if (served == 0 || (events & (Sn_IR_DISCON | Sn_IR_TIMEOUT))) {
+					disconnectAsync(s, 0);
+					setConnectionState(c, CONN_DISCONNECTING);
+				} else if (served == 1) {
+					c->since = getTick(); // idle timer restarts with every request
+				} // 2: partial request, the rest comes with the next RECV
+			} else if (events & (Sn_IR_DISCON | Sn_IR_TIMEOUT)) {
+				closeAsync(s, 0);
+				setConnectionState(c, CONN_CLOSING);
+			} else if (c->established && tickElapsed(c->since, HTTP_IDLE_TIMEOUT)) {
+				disconnectAsync(s, 0);
+				setConnectionState(c, CONN_DISCONNECTING);
+			}
+			break;
+		case CONN_DISCONNECTING:
+			if (result != CMD_ISSUED && result != CMD_WAIT_STATUS) {
+				closeAsync(s, 0);
+				setConnectionState(c, CONN_CLOSING);
+			} else if (tickElapsed(c->since, HTTP_DISCONNECT_TIMEOUT)) {
+				closeAsync(s, 0);
+				setConnectionState(c, CONN_CLOSING);
+			}
+			break;
+		case CONN_CLOSING:
+			if (result != CMD_ISSUED && result != CMD_WAIT_STATUS) {
+				armConnection(c); // no pass without a listener in between
+			}
+			break;
+		}
+		busy |= isSocketCommandBusy(s);
+	}
+	busy |= keepBacklog();
+	return busy;
+}
+
+/*
+ * Send the staged bytes with everything already in TX memory and wait for
+ * SEND_OK. Ends the response: returns 1, or the sendStream result (2, 3)
+ * that cut it short, and clears that for the next one.
+ */
+u_char flushBuffer() {
+	Connection *c = connection;
+	u_char status = c->sendError;
+
+	if (!status) {
+		status = sendStream(c->socket, c->txBuffer, c->writeBufferPointer);
+		if (status == 1 && !waitSendComplete(c->socket)) {
+			status = 3;
 		}
-		receive(0, rxBuffer, lastByte); // get more from W5200
-		readBufferPointer = 0;
 	}
+	c->writeBufferPointer = 0;
+	c->sendError = 0;
+	return status;
+}
 
-	if (lastByte == 0) { // if there are no more bytes in W5200's RX memory...
-		return 0; // we are done, return failure
+/*
+ * Move the staged bytes into the socket's TX memory without sending them.
+ * Only when that memory is full does the pending data go out (sendStream),
+ * so a response leaves as a few full segments on flushBuffer().
+ * Returns 0 once a send has failed, the rest of the response is dropped then.
+ */
+u_char drainBuffer() {
+	Connection *c = connection;
+	u_char status;
+
+	if (c->writeBufferPointer != 0 && !c->sendError) {
+		if (getTXVirtualFreeSize(c->socket) >= c->writeBufferPointer) {
+			writeToTXBufferPiecemeal(c->socket, c->txBuffer, c->writeBufferPointer);
+		} else if ((status = sendStream(c->socket, c->txBuffer, c->writeBufferPointer)) != 1) {
+			c->sendError = status; // peer is gone
+		}
 	}
+	c->writeBufferPointer = 0;
+	return !c->sendError;
+}
 
-	*byte = rxBuffer[readBufferPointer++]; // copy byte
+void addCharToBuffer(u_char character) {
+	if (counting) {
+		countedLength++;
+		return;
+	}
+	if (connection->sendError) {
+		return; // response was cut short, see flushBuffer
+	}
+	connection->txBuffer[connection->writeBufferPointer++] = character;
+	if (connection->writeBufferPointer == TX_MAX_BUF_SIZE) {
+		drainBuffer();
+	}
+}
 
-	return 1; // we have more data, return success
+/*
+ * Write pending buffer bytes plus vector[1..count-1] to W5500's TX memory in one SPI frame.
+ * vector[0] is filled in here with the local buffer. Nothing is sent until the next send(),
+ * unless data already in TX memory leaves too little room: that goes out first.
+ * Returns 0 when the vector still doesn't fit, the local buffer is kept then.
+ */
+u_char addVectorToBuffer(SPIVector *vector, u_char count) {
+	Connection *c = connection;
+	u_char status;
+
+	if (c->sendError)
+		return 0;
+	vector[0].array = c->txBuffer;
+	vector[0].length = c->writeBufferPointer;
+	if (!writeToTXBufferVector(c->socket, vector, count)) {
+		if ((status = sendStream(c->socket, 0, 0)) != 1) {
+			c->sendError = status;
+			return 0;
+		}
+		if (!waitSendComplete(c->socket)) {
+			c->sendError = 3;
+			return 0;
+		}
+		if (!writeToTXBufferVector(c->socket, vector, count))
+			return 0;
+	}
+	c->writeBufferPointer = 0;
+	return 1;
+}
+
+WIZ_RAMFUNC u_char getByteFromBuffer(u_char *byte) {
+	return nextRXByte(&connection->rx, byte);
 }
 
 void waitForData(u_char s) {
-	while ((bytesReceived = getRXReceived(s)) == 0)
-		;
-	//TODO add logic to verify bytesReceived == getSn_RX_RSR(s), indicating all bytes were received
+	while (getRXReceived(s) == 0)
+		waitSocketEvents(s, Sn_IR_RECV | Sn_IR_DISCON | Sn_IR_TIMEOUT);
+	openRXCursor(&connection->rx, s, connection->rxBuffer, RX_MAX_BUF_SIZE);
 }
 
 void waitForConnection(u_char s) {
 	while (getSn_SR(s) != SOCK_ESTABLISHED)
-		;
+		waitSocketEvents(s, Sn_IR_CON | Sn_IR_DISCON | Sn_IR_TIMEOUT);
 }
 
 u_char isConnected(u_char s) {
@@ -439,24 +929,6 @@ void addCharToBufferAsHex(u_char c) {
 u_char toHex(u_char c) {
 	return "0123456789ABCDEF"[c & 0x0F];
 }
-/*
- * Send and return byte via SPI
- */
-u_char sendReceiveByteSPI(u_char byte) {
-	uint8_t receivedByte;
-	//UCB0TXBUF = byte;
-	//while(!(UCB0IFG & UCTXIFG));
-	//while(UCB0STAT & UCBUSY);
-	//receivedByte = UCB0RXBUF;
-	while (!(SPI_getInterruptStatus(ETH_EUSCI_MODULE,ETH_EUSCI_TRAN_INT)));
-
-	SPI_transmitData(ETH_EUSCI_MODULE, byte);
-	while (!(SPI_getInterruptStatus(ETH_EUSCI_MODULE,ETH_EUSCI_TRAN_INT)));
-	receivedByte = SPI_receiveData(ETH_EUSCI_MODULE);
-	//printf("0x%x\n", receivedByte);
-	return receivedByte;
-}
-
 /*
  * Convert one ASCII character to hex (0x00-0x0F)
  * Return 0xFF when invalid
@@ -484,6 +956,16 @@ void resetW5500(void) {
 	delay_ms(200);
 }
 */
+
+/*
+ * W5500 software reset, RST clears itself when the chip is done.
+ * setMR invalidates the register shadow.
+ */
+void resetW5500(void) {
+	setMR(MR_RST);
+	while (getMR() & MR_RST)
+		;
+}
 void delay_us(u_char time_us) {
 	u_char c = 0;
 	while (c++ < time_us) {
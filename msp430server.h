@@ -2,26 +2,68 @@
 #define _MSP430SERVER_H_
 //
 #include "typedefs.h"
+#include "defines.h"
+#include "wizspi.h"
+#include "w5500.h"
+//
+// HTTP connection state
+#define CONN_CLOSED				0x00
+#define CONN_OPENING			0x01	// OPEN issued
+#define CONN_LISTENING			0x02	// LISTEN issued, listening or kept alive, waiting for data
+#define CONN_DISCONNECTING		0x03	// response sent, DISCON issued
+#define CONN_CLOSING			0x04	// CLOSE issued
+
+typedef struct {
+	u_long accepted;		// connections that sent a first byte
+	u_long total;			// sum of accept-to-first-byte latencies, us
+	u_long max;				// us
+} AcceptStats;
+
+typedef struct {
+	u_char socket;
+	u_char state;
+	u_long since;			// tick of the last state change or request
+	u_char established;		// peer connected, idle timer runs
+	u_char firstByte;		// first request of this connection arrived
+	u_long acceptCycle;		// DWT->CYCCNT when CON was dispatched
+	AcceptStats stats;
+	u_char writeBufferPointer;
+	u_char sendError;		// 0, or the sendStream result that cut the response short
+	RXCursor rx;
+	u_char txBuffer[TX_MAX_BUF_SIZE]; // TX Buffer for applications
+	u_char rxBuffer[RX_MAX_BUF_SIZE]; // RX window for applications
+} Connection;
+
+extern Connection connections[];
+extern Connection *connection;
+extern u_char dmx[DMX_UNIVERSES][DMX_CHANNELS];
 //
 void configureW5500(const u_char *sourceIP, const u_char *gatewayIP, const u_char *subnetMask);
 void configureMSP430();
+u_long calibrateSPIClock(void);
+void reportSPICycles(void);
 void resetW5500(void);
 //
 void addStringToBuffer(const u_char *string);
 void addCharToBuffer(u_char character);
 void addIntToBufferAsHex(u_int i);
 void addCharToBufferAsHex(u_char c);
+u_char addVectorToBuffer(SPIVector *vector, u_char count);
 //
 void startClient(u_char s, u_char *destinationIP, u_char port);
 void stopClient(u_char s);
 void startServer(u_char s, u_char port);
 void stopServer(u_char s);
+void startHTTPServer(u_int port);
+u_char serviceHTTPServer(void);
+void reportHTTPStats(void);
 //
-void flushBuffer();
+u_char flushBuffer();
+u_char drainBuffer();
 void sendRequest();
 //
-void addHTTP400ResponseToBuffer();
-void addHTTP200ResponseToBuffer();
+u_char addHTTP400ResponseToBuffer(u_int contentLength, u_char keepAlive);
+u_char addHTTP200ResponseToBuffer(u_int contentLength, u_char keepAlive);
 //
 void openDocument();
 void closeDocument(u_char success);
@@ -32,7 +74,6 @@ u_char isConnected(u_char s);
 u_char parseRequest(Request *request);
 void processRequest(Request *request);
 //
-u_char sendReceiveByteSPI(u_char byte);
 u_char getByteFromBuffer(u_char *byte);
 u_char toHex(u_char);
 u_char asciiToHex(u_char byte);
@@ -0,0 +1,177 @@
+/*
+ * sacn.c
+ *
+ * sACN receiver, one multicast UDP socket per universe. The socket joins
+ * 239.255.hi.lo with the group MAC 01:00:5e:7f:hi:lo in Sn_DHAR, the chip
+ * sends the IGMP join on OPEN. Each datagram's layers are validated from a
+ * header read, slots go from the RX ring straight into the store once the
+ * sequence and priority rules accept the packet.
+ *
+ * One source owns a universe: a higher priority source takes it over, an
+ * equal or lower one is ignored until the owner terminates or goes quiet
+ * for SACN_SOURCE_TIMEOUT. There is no merging.
+ */
+
+#include <string.h>
+#include "defines.h"
+#include "w5500.h"
+#include "wizevent.h"
+#include "tick.h"
+#include "msp430server.h"
+#include "sacn.h"
+
+#if SACN_UNIVERSES > DMX_UNIVERSES
+#error "every sACN universe needs a row in the DMX store"
+#endif
+
+SACNUniverse sacnUniverses[SACN_UNIVERSES];
+SACNStats sacnStats;
+
+static const u_char _acn_id[12] = { 'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0 };
+
+static u_long readLong(const u_char *array) {
+	return ((u_long) array[0] << 24) | ((u_long) array[1] << 16)
+			| ((u_long) array[2] << 8) | array[3];
+}
+
+/*
+ * Join the group of universe u on socket s
+ */
+static void joinUniverse(SACNUniverse *universe, u_char s, u_int u) {
+	u_char mac[6] = { 0x01, 0x00, 0x5E, 0x7F, u >> 8, u };
+	u_char ip[4] = { 239, 255, u >> 8, u };
+
+	universe->socket = s;
+	universe->universe = u;
+	universe->active = 0;
+	setSn_DHAR(s, mac);
+	setSn_DIPR(s, ip);
+	setSn_DPORT(s, SACN_PORT);
+	setSocketEventHandler(s, Sn_IR_RECV, 0);
+	socket(s, Sn_MR_UDP, SACN_PORT, Sn_MR_MULTI); // Sn_MR_MC clear: IGMPv2
+}
+
+void startSACN(void) {
+	u_char i;
+
+	for (i = 0; i < SACN_UNIVERSES; i++) {
+		joinUniverse(&sacnUniverses[i], SACN_SOCKET + i, SACN_UNIVERSE_FIRST + i);
+	}
+}
+
+/*
+ * Flags nibble 0x7 and a PDU length that runs to the end of the datagram
+ */
+static u_char isPDU(const u_char *header, u_int offset, u_int length) {
+	return (header[offset] & 0xF0) == 0x70
+			&& (ntohs((u_char *) header + offset) & 0x0FFF) == length - offset;
+}
+
+/*
+ * Root, framing and DMP layers of a data packet, returns the property
+ * value count (START code and slots) or 0
+ */
+static u_int validatePacket(const u_char *header, u_int length, u_int universe) {
+	u_int count;
+
+	if (length < SACN_HEADER_SIZE || length > SACN_HEADER_SIZE + SACN_MAX_SLOTS)
+		return 0;
+	// root layer
+	if (ntohs((u_char *) header) != 0x0010 || ntohs((u_char *) header + 2) != 0x0000
+			|| memcmp(header + 4, _acn_id, sizeof(_acn_id))
+			|| !isPDU(header, 16, length) || readLong(header + 18) != SACN_VECTOR_ROOT_DATA)
+		return 0;
+	// framing layer
+	if (!isPDU(header, 38, length) || readLong(header + 40) != SACN_VECTOR_FRAMING_DATA
+			|| header[108] > SACN_MAX_PRIORITY || ntohs((u_char *) header + 113) != universe)
+		return 0;
+	// DMP layer: set property, 0xA1 addressing, from 0 in steps of 1
+	if (!isPDU(header, 115, length) || header[117] != SACN_VECTOR_DMP_SET_PROPERTY
+			|| header[118] != 0xA1 || ntohs((u_char *) header + 119) != 0x0000
+			|| ntohs((u_char *) header + 121) != 0x0001)
+		return 0;
+	count = ntohs((u_char *) header + 123);
+	if (count != length - SACN_HEADER_SIZE + 1)
+		return 0;
+	return count;
+}
+
+/*
+ * Sequence and priority rules, returns 1 if the packet goes to the store
+ */
+static u_char acceptPacket(SACNUniverse *universe, const u_char *header) {
+	const u_char *cid = header + 22;
+	u_char priority = header[108];
+	u_char sequence = header[111];
+	u_char options = header[112];
+	u_char owner = universe->active && !memcmp(universe->cid, cid, 16);
+
+	if (owner) {
+		if ((signed char) (sequence - universe->sequence) <= 0
+				&& (signed char) (sequence - universe->sequence) > -SACN_SEQUENCE_WINDOW) {
+			sacnStats.sequence++;
+			return 0;
+		}
+		if (options & SACN_OPTION_TERMINATED) {
+			universe->active = 0;
+			sacnStats.terminated++;
+			return 0;
+		}
+	} else {
+		if (options & SACN_OPTION_TERMINATED)
+			return 0;
+		if (universe->active && priority <= universe->priority
+				&& !tickElapsed(universe->since, SACN_SOURCE_TIMEOUT)) {
+			sacnStats.priority++;
+			return 0;
+		}
+		memcpy(universe->cid, cid, 16);
+		universe->active = 1;
+	}
+	universe->priority = priority;
+	universe->sequence = sequence;
+	universe->since = getTick();
+	// preview data is for visualisers, not for output
+	return !(options & SACN_OPTION_PREVIEW);
+}
+
+static void receiveUniverse(SACNUniverse *universe) {
+	DatagramReader reader;
+	u_char header[SACN_HEADER_SIZE];
+	u_int slots, index = universe->universe - SACN_UNIVERSE_FIRST;
+
+	openDatagrams(&reader, universe->socket);
+	while (nextDatagram(&reader)) {
+		if (readDatagram(&reader, header, SACN_HEADER_SIZE) != SACN_HEADER_SIZE
+				|| !(slots = validatePacket(header, reader.length, universe->universe))) {
+			sacnStats.invalid++;
+			continue;
+		}
+		if (header[125] != 0x00) // alternate START codes are not DMX levels
+			continue;
+		if (!acceptPacket(universe, header))
+			continue;
+		slots--; // START code
+		if (slots > DMX_CHANNELS) {
+			slots = DMX_CHANNELS;
+		}
+		readDatagram(&reader, dmx[index], slots);
+		sacnStats.frames++;
+	}
+	commitDatagrams(&reader);
+}
+
+/*
+ * Drain every universe that signalled RECV, returns 1 if any did
+ */
+u_char serviceSACN(void) {
+	u_char i, received = 0;
+
+	for (i = 0; i < SACN_UNIVERSES; i++) {
+		if (takeSocketEvents(sacnUniverses[i].socket, Sn_IR_RECV)) {
+			receiveUniverse(&sacnUniverses[i]);
+			received = 1;
+		}
+	}
+	return received;
+}
@@ -0,0 +1,47 @@
+/*
+ * sacn.h
+ *
+ * sACN (ANSI E1.31) multicast receiver feeding the dmx[][] store
+ */
+
+#ifndef SACN_H_
+#define SACN_H_
+
+#include "typedefs.h"
+
+#define SACN_HEADER_SIZE		126		// root, framing and DMP layers up to the first slot
+#define SACN_VECTOR_ROOT_DATA	0x00000004UL
+#define SACN_VECTOR_FRAMING_DATA	0x00000002UL
+#define SACN_VECTOR_DMP_SET_PROPERTY	0x02
+#define SACN_OPTION_PREVIEW		0x80
+#define SACN_OPTION_TERMINATED	0x40
+#define SACN_MAX_SLOTS			512
+#define SACN_MAX_PRIORITY		200
+#define SACN_SOURCE_TIMEOUT		2500	// ms, network data loss
+#define SACN_SEQUENCE_WINDOW	20		// a sequence up to this far behind is out of order
+
+typedef struct {
+	u_char socket;
+	u_int universe;			// E1.31 universe, 1..63999
+	u_char active;			// a source owns the universe
+	u_char cid[16];			// owning source
+	u_char priority;
+	u_char sequence;
+	u_long since;			// tick of the last accepted packet
+} SACNUniverse;
+
+typedef struct {
+	u_long frames;			// packets written to the store
+	u_long invalid;			// failed layer validation
+	u_long sequence;		// dropped as out of order
+	u_long priority;		// dropped for a higher priority or earlier equal source
+	u_long terminated;
+} SACNStats;
+
+extern SACNUniverse sacnUniverses[];
+extern SACNStats sacnStats;
+
+void startSACN(void);
+u_char serviceSACN(void);
+
+#endif /* SACN_H_ */
@@ -3,11 +3,15 @@
 
 // HTTP request
 const u_char sGET[] = "GET /";
+const u_char sHTTP_1_1[] = "http/1.1";			// lower case, compared case-insensitively
+const u_char sHEADER_CONNECTION[] = "connection:";
 // HTTP response header
 const u_char sRESPONSE_STATUS_OK[] = "HTTP/1.1 200 OK\r\n";
 const u_char sRESPONSE_STATUS_BAD_REQ[] = "HTTP/1.1 400 Bad Request\r\n";
 const u_char sRESPONSE_CONTENT_TYPE_XML[] = "Content-Type: text/xml\r\n";
-const u_char sRESPONSE_CONTENT_LENGTH[] = "Content-Length:     "; // 4 spaces could be replaced in W5200's buffer with the length after all content has been generated, but not sure if it's possible
+const u_char sRESPONSE_CONTENT_LENGTH[] = "Content-Length: "; // value comes from a counting pass over the body
+const u_char sRESPONSE_CONNECTION_KEEP_ALIVE[] = "Connection: keep-alive\r\n";
+const u_char sRESPONSE_CONNECTION_CLOSE[] = "Connection: close\r\n";
 const u_char sNEW_LINE[] = "\r\n";
 const u_char sREQUEST_GET[] = "GET ";
 const u_char sREQUEST_HTTP[] = " HTTP/1.1";
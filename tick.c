@@ -0,0 +1,30 @@
+/*
+ * tick.c
+ *
+ * Millisecond time base from SysTick, wraps after ~49 days which the
+ * unsigned subtraction in tickElapsed handles.
+ */
+
+#include "defines.h"
+#include "tick.h"
+#include "driverlib.h"
+
+static volatile u_long _tick;
+
+void configureTick(void) {
+	SysTick_setPeriod(MAP_CS_getMCLK() / 1000);
+	SysTick_enableInterrupt();
+	SysTick_enableModule();
+}
+
+u_long getTick(void) {
+	return _tick;
+}
+
+u_char tickElapsed(u_long since, u_long ms) {
+	return (u_long) (_tick - since) >= ms;
+}
+
+void SysTick_Handler(void) {
+	_tick++;
+}
@@ -0,0 +1,16 @@
+/*
+ * tick.h
+ *
+ * Millisecond time base from SysTick
+ */
+
+#ifndef TICK_H_
+#define TICK_H_
+
+#include "typedefs.h"
+
+void configureTick(void);
+u_long getTick(void);
+u_char tickElapsed(u_long since, u_long ms);
+
+#endif /* TICK_H_ */
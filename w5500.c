@@ -1,5 +1,7 @@
 #include "defines.h"
 #include "w5500.h"
+#include "wizspi.h"
+#include "tick.h"
 #include <stdlib.h>
 #include "driverlib.h"
 #include <stdio.h>
@@ -11,13 +13,137 @@ const u_char _socket_reg_block[8] = { 0x08, 0x28, 0x48, 0x68, 0x88, 0xA8, 0xC8,
 const u_char _socket_txb_block[8] = { 0x10, 0x30, 0x50, 0x70, 0x90, 0xB0, 0xD0, 0xF0 };
 const u_char _socket_rxb_block[8] = { 0x18, 0x38, 0x58, 0x78, 0x98, 0xB8, 0xD8, 0xF8 };
 
-extern u_char sendReceiveByteSPI(u_char byte);
-
 u_int _tx_wr_cache[8], _rx_rd_cache[8];  /* Used for "piecemeal" writes & reads when 
 					  * we update TX_WR or RX_RD but the WizNet still
 					  * gives us the old value until we perform a CR
 					  * command action on the socket.
 					  */
+static u_int _tx_sent[8];		// TX_WR at the last SEND, data past it is written but not sent
+static u_char _send_pending;	// bit per socket, SEND issued and SEND_OK not yet taken
+static SPITransaction _tx_wr_transaction[8] = {
+	{ {0}, 0, 0, 0, 0, 0, 0, 0, 1 }, { {0}, 0, 0, 0, 0, 0, 0, 0, 1 },
+	{ {0}, 0, 0, 0, 0, 0, 0, 0, 1 }, { {0}, 0, 0, 0, 0, 0, 0, 0, 1 },
+	{ {0}, 0, 0, 0, 0, 0, 0, 0, 1 }, { {0}, 0, 0, 0, 0, 0, 0, 0, 1 },
+	{ {0}, 0, 0, 0, 0, 0, 0, 0, 1 }, { {0}, 0, 0, 0, 0, 0, 0, 0, 1 } }; // Sn_TX_WR updates queued by async writes
+static u_char _tx_wr_bytes[8][2];
+
+SocketSnapshot _socket_snapshot[8];
+u_char _socket_snapshot_valid;	// bit per socket
+
+/*
+ * Register shadow: image of the common block and each socket block 0x00-0x1F
+ * with a valid bit per register byte. Only configuration registers we write
+ * ourselves go through it. On TCP sockets the chip writes the peer into
+ * Sn_DIPR/Sn_DPORT, so those bytes are only served from the shadow when the
+ * socket mode is known and isn't TCP.
+ */
+#define SHADOW_BLOCK_SIZE	0x20
+#define SHADOW_PEER_MASK	0x0003F000UL	// Sn_DIPR 0x0C-0x0F, Sn_DPORT 0x10-0x11
+
+static u_char _shadow[9][SHADOW_BLOCK_SIZE];	// [0] common, [1 + s] socket s
+static u_long _shadow_valid[9];
+
+static u_char shadowIndex(u_char control) {
+	if (control == COMM_REG_BLOCK)
+		return 0;
+	return 1 + (control >> 5);
+}
+
+static u_long shadowMask(u_char offset, u_int length) {
+	return ((length >= 32 ? 0UL : (1UL << length)) - 1) << offset;
+}
+
+void writeShadowedRegister(u_char offset, u_char control, u_char* array,
+		u_int length) {
+	u_char index = shadowIndex(control);
+	u_int c;
+
+	writeRegisterArray(offset, control, array, length);
+	for (c = 0; c < length; c++) {
+		_shadow[index][offset + c] = array[c];
+	}
+	_shadow_valid[index] |= shadowMask(offset, length);
+}
+
+void readShadowedRegister(u_char offset, u_char control, u_char* array,
+		u_int length) {
+	u_char index = shadowIndex(control);
+	u_long mask = shadowMask(offset, length);
+	u_int c;
+
+	if (index != 0 && (mask & SHADOW_PEER_MASK)
+			&& (!(_shadow_valid[index] & 1)
+					|| (_shadow[index][Sn_MR] & 0x0F) == Sn_MR_TCP)) {
+		readRegisterArray(offset, control, array, length);
+		return;
+	}
+	if ((_shadow_valid[index] & mask) != mask) {
+		readRegisterArray(offset, control, &_shadow[index][offset], length);
+		_shadow_valid[index] |= mask;
+	}
+	for (c = 0; c < length; c++) {
+		array[c] = _shadow[index][offset + c];
+	}
+}
+
+void writeShadowedByte(u_char offset, u_char control, u_char byte) {
+	writeShadowedRegister(offset, control, &byte, 1);
+}
+
+u_char readShadowedByte(u_char offset, u_char control) {
+	u_char byte;
+	readShadowedRegister(offset, control, &byte, 1);
+	return byte;
+}
+
+void writeShadowedWord(u_char offset, u_char control, u_int word) {
+	u_char bytes[2];
+	htons(word, bytes);
+	writeShadowedRegister(offset, control, bytes, 2);
+}
+
+u_int readShadowedWord(u_char offset, u_char control) {
+	u_char bytes[2];
+	readShadowedRegister(offset, control, bytes, 2);
+	return ntohs(bytes);
+}
+
+/**
+ * forget everything we know about the chip, required after any reset
+ */
+void invalidateRegisterShadow(void) {
+	u_char c;
+	for (c = 0; c < 9; c++) {
+		_shadow_valid[c] = 0;
+	}
+	_socket_snapshot_valid = 0;
+}
+
+void writeModeRegister(u_char mr) {
+	writeRegisterByte(MR, COMM_REG_BLOCK, mr);
+	if (mr & MR_RST) {
+		invalidateRegisterShadow();
+	}
+}
+
+
+/**
+ * read the whole socket register block in one SPI transaction.
+ * with SNAPSHOT_REUSE the last snapshot is returned until a command or
+ * interrupt clear on the socket invalidates it.
+ */
+SocketSnapshot *snapshotSocket(u_char s, u_char reuse) {
+	if (!reuse || !(_socket_snapshot_valid & (1 << s))) {
+		readRegisterArray(Sn_MR, _socket_reg_block[s],
+				(u_char *) &_socket_snapshot[s], SOCKET_SNAPSHOT_SIZE);
+		_socket_snapshot_valid |= (1 << s);
+	}
+	return &_socket_snapshot[s];
+}
+
+void invalidateSocketSnapshot(u_char s) {
+	_socket_snapshot_valid &= ~(1 << s);
+}
 
 /**
  * wait until socket close_sd status
@@ -55,6 +181,7 @@ void startListening(u_char s) {
  */
 void listen(u_char s) {
 	setSn_CR(s, Sn_CR_LISTEN);
+	invalidateSocketSnapshot(s);
 	while (getSn_CR(s))
 		;
 }
@@ -64,6 +191,7 @@ void listen(u_char s) {
  */
 void disconnect(u_char s) {
 	setSn_CR(s, Sn_CR_DISCON);
+	invalidateSocketSnapshot(s);
 	while (getSn_CR(s))
 		;
 }
@@ -73,9 +201,11 @@ void disconnect(u_char s) {
  */
 void close_s(u_char s) {
 	setSn_CR(s, Sn_CR_CLOSE);
+	invalidateSocketSnapshot(s);
 	while (getSn_CR(s))
 		;
 	setSn_IR(s, 0xFF);
+	_send_pending &= ~(1 << s);
 }
 
 /**
@@ -90,6 +220,7 @@ void socket(u_char s, u_char protocol, u_int port, u_char flag) {
 		setSn_PORT(s, localPort);
 	}
 	setSn_CR(s, Sn_CR_OPEN);
+	invalidateSocketSnapshot(s);
 	while (getSn_CR(s))
 		;
 	refreshTXBufferCache(s);
@@ -104,6 +235,7 @@ void connect(u_char s, u_char * addr, u_int port) {
 	setSn_DIPR(s, addr);
 	setSn_DPORT(s, port);
 	setSn_CR(s, Sn_CR_CONNECT);
+	invalidateSocketSnapshot(s);
 	while (getSn_CR(s))
 		;
 	refreshTXBufferCache(s);
@@ -121,152 +253,519 @@ void connect(u_char s, u_char * addr, u_int port) {
 }
 
 
-// register read & write
-u_char readRegisterByte(u_char offset, u_char control) {
-	uint8_t byte;
-
-	wizSelect();;
-	sendReceiveByteSPI(0);
-	sendReceiveByteSPI(offset);
-	sendReceiveByteSPI(control); // RWB_READ is 0, so we just skip it
-	byte = sendReceiveByteSPI(0);
-	wizDeselect();;
-	//if(byte != 0x0a){
-		//printf("0x%x\n", byte);
-	//}
-	return byte;
+/*
+ * Start a cursor over what socket s has received so far
+ */
+void openRXCursor(RXCursor *cursor, u_char s, u_char *buffer, u_int size) {
+	cursor->socket = s;
+	cursor->buffer = buffer;
+	cursor->size = size;
+	cursor->length = 0;
+	cursor->position = 0;
+	cursor->consumed = 0;
+	refreshRXBufferCache(s);
+	cursor->remaining = getRXReceived(s);
 }
-void writeRegisterByte(u_char offset, u_char control, u_char byte) {
-	wizSelect();;
 
-	sendReceiveByteSPI(0);
-	sendReceiveByteSPI(offset);
-	sendReceiveByteSPI(control | RWB_WRITE);
-	sendReceiveByteSPI(byte);
+/*
+ * Next byte, refilling the window from the ring when it runs out. No RECV is
+ * issued here, 0 when everything received at open time has been read.
+ */
+WIZ_RAMFUNC u_char nextRXByte(RXCursor *cursor, u_char *byte) {
+	if (cursor->position == cursor->length) {
+		if (cursor->remaining == 0)
+			return 0;
+		cursor->length = cursor->remaining < cursor->size ? cursor->remaining : cursor->size;
+		readFromRXBufferPiecemeal(cursor->socket, cursor->buffer, cursor->length);
+		cursor->remaining -= cursor->length;
+		cursor->consumed += cursor->length;
+		cursor->position = 0;
+	}
+	*byte = cursor->buffer[cursor->position++];
+	return 1;
+}
 
-	wizDeselect();;
+/*
+ * Everything received at open time has been read
+ */
+u_char isRXCursorDrained(RXCursor *cursor) {
+	return cursor->position == cursor->length && cursor->remaining == 0;
 }
-u_int readRegisterWord(u_char offset, u_char control) {
-	u_int word;
-	wizSelect();;
 
-	sendReceiveByteSPI(0);
-	sendReceiveByteSPI(offset);
-	sendReceiveByteSPI(control); // RWB_READ is 0, so we just skip it
-	word = sendReceiveByteSPI(0);
-	word <<= 8;
-	word |= sendReceiveByteSPI(0);
+/*
+ * Hand mapped bytes the caller hasn't read back to the ring, they stay for the next cursor
+ */
+static void returnRXBytes(RXCursor *cursor, u_int length) {
+	u_char s = cursor->socket;
 
-	wizDeselect();;
-	return word;
+	if (length == 0)
+		return;
+	_rx_rd_cache[s] -= length;
+	setSn_RX_RD(s, _rx_rd_cache[s]);
+	cursor->consumed -= length;
 }
-void writeRegisterWord(u_char offset, u_char control, u_int word) {
-	wizSelect();;
 
-	sendReceiveByteSPI(0);
-	sendReceiveByteSPI(offset);
-	sendReceiveByteSPI(control | RWB_WRITE);
-	sendReceiveByteSPI(word >> 8);
-	sendReceiveByteSPI(word);
+/*
+ * Give back everything mapped so far, nothing is released
+ */
+void rewindRXCursor(RXCursor *cursor) {
+	cursor->remaining += cursor->consumed;
+	returnRXBytes(cursor, cursor->consumed);
+	cursor->length = 0;
+	cursor->position = 0;
+}
 
-	wizDeselect();;
+/*
+ * Release what has been read to the chip with a single RECV. The unread
+ * rest of the window goes back to the ring, so data behind a request
+ * (a pipelined one) is still there for the next cursor.
+ */
+void commitRXCursor(RXCursor *cursor) {
+	returnRXBytes(cursor, cursor->length - cursor->position);
+	cursor->length = cursor->position;
+	if (cursor->consumed == 0)
+		return;
+	setSn_CR(cursor->socket, Sn_CR_RECV);
+	invalidateSocketSnapshot(cursor->socket);
+	while (getSn_CR(cursor->socket))
+		;
+	cursor->consumed = 0;
 }
-void readRegisterArray(u_char offset, u_char control, u_char* array,
-		u_int length) {
-	u_int c;
 
-	wizSelect();;
+/*
+ * UDP datagrams in the RX ring, each an 8 byte header (source IP, source
+ * port, payload length) and the payload. The reader walks every datagram
+ * received at open time off _rx_rd_cache; Sn_RX_RD and a single RECV are
+ * written on commit, so a burst costs one command however many it holds.
+ */
+u_int openDatagrams(DatagramReader *reader, u_char s) {
+	reader->socket = s;
+	reader->length = 0;
+	reader->count = 0;
+	refreshRXBufferCache(s);
+	reader->next = _rx_rd_cache[s];
+	reader->remaining = getRXReceived(s);
+	return reader->remaining;
+}
 
-	sendReceiveByteSPI(0);
-	sendReceiveByteSPI(offset);
-	sendReceiveByteSPI(control); // RWB_READ is 0, so we just skip it
-	for (c = 0; c < length; c++) {
-		*array = sendReceiveByteSPI(0);
-		array++;
+/*
+ * Skip what is left of the current datagram and read the next header,
+ * 0 when none is left
+ */
+WIZ_RAMFUNC u_char nextDatagram(DatagramReader *reader) {
+	u_char s = reader->socket;
+	u_char header[8];
+
+	_rx_rd_cache[s] = reader->next;
+	if (reader->remaining < 8)
+		return 0;
+	readMemoryArray(reader->next, _socket_rxb_block[s], header, 8);
+	reader->addr[0] = header[0];
+	reader->addr[1] = header[1];
+	reader->addr[2] = header[2];
+	reader->addr[3] = header[3];
+	reader->port = ntohs(header + 4);
+	reader->length = ntohs(header + 6);
+	if (reader->length > reader->remaining - 8) {
+		// the chip only stores whole datagrams, a header like this means we lost sync
+		reader->next += reader->remaining;
+		reader->remaining = 0;
+		reader->count++;
+		_rx_rd_cache[s] = reader->next;
+		return 0;
 	}
+	reader->remaining -= 8 + reader->length;
+	_rx_rd_cache[s] = reader->next + 8;
+	reader->next += 8 + reader->length;
+	reader->count++;
+	return 1;
+}
+
+/*
+ * Copy up to length payload bytes of the current datagram, returns how many
+ */
+WIZ_RAMFUNC u_int readDatagram(DatagramReader *reader, u_char *buffer, u_int length) {
+	u_char s = reader->socket;
+	u_int left = (reader->next - _rx_rd_cache[s]) & 0xFFFF;
 
-	wizDeselect();;
+	if (length > left) {
+		length = left;
+	}
+	if (length == 0)
+		return 0;
+	readMemoryArray(_rx_rd_cache[s], _socket_rxb_block[s], buffer, length);
+	_rx_rd_cache[s] += length;
+	return length;
 }
-void writeRegisterArray(u_char offset, u_char control, u_char* array,
-		u_int length) {
-	u_int c;
 
-	wizSelect();;
+/*
+ * Release every datagram walked so far with one Sn_RX_RD write and one RECV
+ */
+void commitDatagrams(DatagramReader *reader) {
+	u_char s = reader->socket;
 
-	sendReceiveByteSPI(0);
-	sendReceiveByteSPI(offset);
-	sendReceiveByteSPI(control | RWB_WRITE);
-	for (c = 0; c < length; c++) {
-		sendReceiveByteSPI(*array++);
+	if (reader->count == 0)
+		return;
+	_rx_rd_cache[s] = reader->next;
+	setSn_RX_RD(s, reader->next);
+	setSn_CR(s, Sn_CR_RECV);
+	invalidateSocketSnapshot(s);
+	while (getSn_CR(s))
+		;
+	reader->count = 0;
+}
+
+/*
+ * Receive one datagram, the rest of a longer payload is dropped.
+ * Returns the bytes copied, 0 if nothing was waiting.
+ */
+u_int recvfrom(u_char s, u_char *buffer, u_int length, u_char *addr, u_int *port) {
+	DatagramReader reader;
+
+	if (openDatagrams(&reader, s) == 0 || !nextDatagram(&reader)) {
+		commitDatagrams(&reader);
+		return 0;
 	}
+	length = readDatagram(&reader, buffer, length);
+	if (addr) {
+		addr[0] = reader.addr[0];
+		addr[1] = reader.addr[1];
+		addr[2] = reader.addr[2];
+		addr[3] = reader.addr[3];
+	}
+	if (port) {
+		*port = reader.port;
+	}
+	// only this one is released, anything behind it stays for the next call
+	reader.remaining = 0;
+	commitDatagrams(&reader);
+	return length;
+}
+
+/*
+ * Write buffer behind anything already written, SEND it all and wait.
+ * status is the Sn_SR the socket has to be in.
+ */
+static u_char sendUnconnected(u_char s, const u_char *buffer, u_int length, u_char status) {
+	SocketSnapshot *snapshot;
+	u_char ir;
 
-	wizDeselect();;
+	if (((_tx_wr_cache[s] - _tx_sent[s]) & 0xFFFF) + length > getSocketTXSize(s)) {
+		return 2;
+	}
+	do {
+		snapshot = snapshotSocket(s, SNAPSHOT_REFRESH);
+		if (snapshot->sr != status) {
+			return 2;
+		}
+	} while (ntohs(snapshot->tx_fsr) < length);
+
+	writeToTXBufferPiecemeal(s, (u_char *) buffer, length);
+	setSn_CR(s, Sn_CR_SEND);
+	invalidateSocketSnapshot(s);
+	_tx_sent[s] = _tx_wr_cache[s];
+	while (getSn_CR(s))
+		;
+	while (!((ir = getSn_IR(s)) & (Sn_IR_SEND_OK | Sn_IR_TIMEOUT)))
+		;
+	setSn_IR(s, ir & (Sn_IR_SEND_OK | Sn_IR_TIMEOUT));
+	return (ir & Sn_IR_SEND_OK) ? 1 : 0;
 }
-// memory read & write
-u_char readMemoryByte(u_int addr, u_char control) {
-	u_char byte;
-	wizSelect();;
 
-	sendReceiveByteSPI(addr >> 8);
-	sendReceiveByteSPI(addr);
-	sendReceiveByteSPI(control); // RWB_READ is 0, so we just skip it
-	byte = sendReceiveByteSPI(0);
+/*
+ * Send one datagram to addr:port and wait for it to leave. Data already
+ * written past the last SEND (vector writes) goes out in front of buffer.
+ * Returns 1 on SEND_OK, 0 on ARP or send timeout, 2 if the socket isn't
+ * open for datagrams or the datagram can't fit its TX memory.
+ */
+u_char sendto(u_char s, const u_char *buffer, u_int length, u_char *addr, u_int port) {
+	u_char peer[4];
 
-	wizDeselect();;
-	return byte;
+	// destination is served from the shadow on UDP sockets, a reply to the same peer writes nothing
+	getSn_DIPR(s, peer);
+	if (peer[0] != addr[0] || peer[1] != addr[1] || peer[2] != addr[2] || peer[3] != addr[3]) {
+		setSn_DIPR(s, addr);
+	}
+	if (getSn_DPORT(s) != port) {
+		setSn_DPORT(s, port);
+	}
+	return sendUnconnected(s, buffer, length, SOCK_UDP);
 }
-void writeMemoryByte(u_int addr, u_char control, u_char byte) {
-	wizSelect();;
 
-	sendReceiveByteSPI(addr >> 8);
-	sendReceiveByteSPI(addr);
-	sendReceiveByteSPI(control | RWB_WRITE);
-	sendReceiveByteSPI(byte);
+/*
+ * MACRAW frames in the RX ring carry a 2 byte header, the frame length
+ * including itself. Walked with the datagram reader: addr and port are
+ * unused, length is the Ethernet frame from destination MAC on, no FCS.
+ */
+WIZ_RAMFUNC u_char nextFrame(DatagramReader *reader) {
+	u_char s = reader->socket;
+	u_char header[2];
+	u_int length;
 
-	wizDeselect();;
+	_rx_rd_cache[s] = reader->next;
+	if (reader->remaining < 2)
+		return 0;
+	readMemoryArray(reader->next, _socket_rxb_block[s], header, 2);
+	length = ntohs(header);
+	if (length < 2 || length > reader->remaining) {
+		reader->next += reader->remaining;
+		reader->remaining = 0;
+		reader->count++;
+		_rx_rd_cache[s] = reader->next;
+		return 0;
+	}
+	reader->length = length - 2;
+	reader->remaining -= length;
+	_rx_rd_cache[s] = reader->next + 2;
+	reader->next += length;
+	reader->count++;
+	return 1;
 }
-void readMemoryArray(u_int addr, u_char control, u_char* array, u_int length) {
-	u_int c;
 
-	wizSelect();;
+/*
+ * Send a complete Ethernet frame (MACs, EtherType, payload) on a MACRAW socket
+ */
+u_char sendFrame(u_char s, const u_char *frame, u_int length) {
+	return sendUnconnected(s, frame, length, SOCK_MACRAW);
+}
 
-	sendReceiveByteSPI(addr >> 8);
-	sendReceiveByteSPI(addr);
-	sendReceiveByteSPI(control); // RWB_READ is 0, so we just skip it
-	for (c = 0; c < length; c++) {
-		*array = sendReceiveByteSPI(0);
-		array++;
+static u_char isMemorySize(u_char kb) {
+	return kb == 0 || kb == 1 || kb == 2 || kb == 4 || kb == 8 || kb == 16;
+}
+
+/*
+ * Program Sn_TXBUF_SIZE/Sn_RXBUF_SIZE for all sockets, call with every socket closed.
+ * Returns 0 and leaves the chip alone when a size is invalid or a pool is overcommitted.
+ */
+u_char applyMemoryProfile(const MemoryProfile *profile) {
+	u_char s, tx = 0, rx = 0;
+
+	for (s = 0; s < 8; s++) {
+		if (!isMemorySize(profile->tx[s]) || !isMemorySize(profile->rx[s]))
+			return 0;
+		tx += profile->tx[s];
+		rx += profile->rx[s];
 	}
+	if (tx > SOCKET_MEMORY_TOTAL || rx > SOCKET_MEMORY_TOTAL)
+		return 0;
+	for (s = 0; s < 8; s++) {
+		// written through the shadow, later size lookups don't touch the bus
+		setSn_TXBUF_SIZE(s, profile->tx[s]);
+		setSn_RXBUF_SIZE(s, profile->rx[s]);
+	}
+	return 1;
+}
 
-	wizDeselect();;
+u_int getSocketTXSize(u_char s) {
+	return getSn_TxMAX(s);
 }
-void writeMemoryArray(u_int addr, u_char control, u_char* array, u_int length) {
-	u_int c;
 
-	wizSelect();;
+u_int getSocketRXSize(u_char s) {
+	return getSn_RxMAX(s);
+}
 
-	sendReceiveByteSPI(addr >> 8);
-	sendReceiveByteSPI(addr);
-	sendReceiveByteSPI(control | RWB_WRITE);
-	for (c = 0; c < length; c++) {
-		sendReceiveByteSPI(*array++);
+/*
+ * Non-blocking commands: issue Sn_CR and return, pollSocketCommand advances
+ * the state from Sn_CR and Sn_SR and runs the callback once on completion.
+ */
+typedef struct {
+	u_char state;
+	u_char command;
+	u_char status;		// Sn_SR to wait for, SOCK_ANY for none
+	u_int timeout;		// ms, 0 for none
+	u_long start;
+	SocketCommandCallback callback;
+} SocketCommand;
+
+static SocketCommand _socket_command[8];
+
+static void finishSocketCommand(u_char s, u_char result);
+
+void issueSocketCommand(u_char s, u_char command, u_char status, u_int timeout,
+		SocketCommandCallback callback) {
+	SocketCommand *c = &_socket_command[s];
+
+	// the chip takes one command at a time per socket
+	while (c->state == CMD_ISSUED) {
+		pollSocketCommand(s);
+	}
+	// a command still waiting for its status is superseded, complete it as failed
+	if (c->state == CMD_WAIT_STATUS) {
+		finishSocketCommand(s, CMD_FAILED);
 	}
+	c->command = command;
+	c->status = status;
+	c->timeout = timeout;
+	c->callback = callback;
+	c->start = getTick();
+	c->state = CMD_ISSUED;
+	setSn_CR(s, command);
+	invalidateSocketSnapshot(s);
+}
+
+static void finishSocketCommand(u_char s, u_char result) {
+	SocketCommand *c = &_socket_command[s];
 
-	wizDeselect();;
+	c->state = result;
+	if (c->callback) {
+		c->callback(s, result);
+	}
+}
+
+u_char pollSocketCommand(u_char s) {
+	SocketCommand *c = &_socket_command[s];
+	u_char sr;
+
+	if (c->state == CMD_ISSUED) {
+		if (getSn_CR(s) == 0) {
+			if (c->command == Sn_CR_OPEN || c->command == Sn_CR_CONNECT) {
+				refreshTXBufferCache(s);
+				refreshRXBufferCache(s);
+			} else if (c->command == Sn_CR_CLOSE) {
+				setSn_IR(s, 0xFF);
+				_send_pending &= ~(1 << s);
+			}
+			c->state = CMD_WAIT_STATUS;
+		}
+	}
+	if (c->state == CMD_WAIT_STATUS) {
+		sr = c->status == SOCK_ANY ? SOCK_ANY : getSn_SR(s);
+		if (sr == c->status) {
+			finishSocketCommand(s, CMD_DONE);
+		} else if (sr == SOCK_CLOSED && c->command != Sn_CR_OPEN) {
+			finishSocketCommand(s, CMD_FAILED);
+		}
+	}
+	if ((c->state == CMD_ISSUED || c->state == CMD_WAIT_STATUS) && c->timeout
+			&& tickElapsed(c->start, c->timeout)) {
+		finishSocketCommand(s, CMD_TIMEOUT);
+	}
+	return c->state;
 }
-void fillMemoryArray(u_int addr, u_char control, u_char value, u_int length) {
-	u_int c;
 
-	wizSelect();;
+void pollSocketCommands(void) {
+	u_char s;
 
-	sendReceiveByteSPI(addr >> 8);
-	sendReceiveByteSPI(addr);
-	sendReceiveByteSPI(control | RWB_WRITE);
-	for (c = 0; c < length; c++) {
-		sendReceiveByteSPI(value);
+	for (s = 0; s < 8; s++) {
+		if (isSocketCommandBusy(s)) {
+			pollSocketCommand(s);
+		}
 	}
+}
+
+u_char isSocketCommandBusy(u_char s) {
+	return _socket_command[s].state == CMD_ISSUED
+			|| _socket_command[s].state == CMD_WAIT_STATUS;
+}
+
+void socketAsync(u_char s, u_char protocol, u_int port, u_char flag,
+		SocketCommandCallback callback) {
+	static const u_char opened[] = { SOCK_CLOSED, SOCK_INIT, SOCK_UDP, SOCK_IPRAW, SOCK_MACRAW };
+
+	setSn_MR(s, protocol | flag);
+	if (port != 0) {
+		setSn_PORT(s, port);
+	} else {
+		localPort++;
+		setSn_PORT(s, localPort);
+	}
+	issueSocketCommand(s, Sn_CR_OPEN,
+			(protocol & 0x0F) < sizeof(opened) ? opened[protocol & 0x0F] : SOCK_ANY,
+			SOCKET_COMMAND_TIMEOUT, callback);
+}
+
+/*
+ * Completes once the command is accepted, a peer may already have moved the socket past SOCK_LISTEN
+ */
+void listenAsync(u_char s, SocketCommandCallback callback) {
+	issueSocketCommand(s, Sn_CR_LISTEN, SOCK_ANY, SOCKET_COMMAND_TIMEOUT, callback);
+}
+
+/*
+ * Completes on SOCK_ESTABLISHED, fails when the chip gives up (RTR/RCR) and closes the socket
+ */
+void connectAsync(u_char s, u_char * addr, u_int port,
+		SocketCommandCallback callback) {
+	setSn_DIPR(s, addr);
+	setSn_DPORT(s, port);
+	issueSocketCommand(s, Sn_CR_CONNECT, SOCK_ESTABLISHED, 0, callback);
+}
+
+void disconnectAsync(u_char s, SocketCommandCallback callback) {
+	issueSocketCommand(s, Sn_CR_DISCON, SOCK_CLOSED, 0, callback);
+}
+
+void closeAsync(u_char s, SocketCommandCallback callback) {
+	issueSocketCommand(s, Sn_CR_CLOSE, SOCK_CLOSED, SOCKET_COMMAND_TIMEOUT, callback);
+}
 
-	wizDeselect();;
+// register read & write
+// single registers are polled directly once the SPI queue has drained, arrays go through the queue
+u_char readRegisterByte(u_char offset, u_char control) {
+	return wizReadByte(offset, control);
+}
+void writeRegisterByte(u_char offset, u_char control, u_char byte) {
+	wizWriteByte(offset, control, byte);
+}
+u_int readRegisterWord(u_char offset, u_char control) {
+	return wizReadWord(offset, control);
+}
+void writeRegisterWord(u_char offset, u_char control, u_int word) {
+	wizWriteWord(offset, control, word);
+}
+void readRegisterArray(u_char offset, u_char control, u_char* array,
+		u_int length) {
+	readMemoryArray(offset, control, array, length);
+}
+void writeRegisterArray(u_char offset, u_char control, u_char* array,
+		u_int length) {
+	writeMemoryArray(offset, control, array, length);
+}
+// memory read & write
+u_char readMemoryByte(u_int addr, u_char control) {
+	u_char byte;
+	readMemoryArray(addr, control, &byte, 1);
+	return byte;
+}
+void writeMemoryByte(u_int addr, u_char control, u_char byte) {
+	writeMemoryArray(addr, control, &byte, 1);
+}
+WIZ_RAMFUNC void readMemoryArray(u_int addr, u_char control, u_char* array, u_int length) {
+	SPITransaction transaction;
+	setupSPITransaction(&transaction, addr, control, SPI_READ, array, length);
+	runSPITransaction(&transaction);
+}
+WIZ_RAMFUNC void writeMemoryArray(u_int addr, u_char control, u_char* array, u_int length) {
+	SPITransaction transaction;
+	setupSPITransaction(&transaction, addr, control, SPI_WRITE, array, length);
+	runSPITransaction(&transaction);
+}
+WIZ_RAMFUNC void fillMemoryArray(u_int addr, u_char control, u_char value, u_int length) {
+	SPITransaction transaction;
+	setupSPITransaction(&transaction, addr, control, SPI_FILL, 0, length);
+	transaction.value = value;
+	runSPITransaction(&transaction);
+}
+/**
+ * stream all segments behind a single address/control header in one CS frame
+ */
+WIZ_RAMFUNC void writeMemoryVector(u_int addr, u_char control, const SPIVector *vector,
+		u_char count) {
+	SPITransaction transaction;
+	setupSPITransaction(&transaction, addr, control, SPI_VECTOR, 0, 0);
+	transaction.vector = vector;
+	transaction.count = count;
+	runSPITransaction(&transaction);
+}
+/**
+ * queue a memory write and return, the caller keeps array and transaction
+ * alive until transaction->done is set or the callback runs
+ */
+WIZ_RAMFUNC void writeMemoryArrayAsync(u_int addr, u_char control, u_char* array,
+		u_int length, SPITransaction *transaction, SPICallback callback) {
+	setupSPITransaction(transaction, addr, control, SPI_WRITE, array, length);
+	transaction->callback = callback;
+	submitSPITransaction(transaction);
 }
 
 void writeToTXBuffer(u_char s, u_char *array, u_int length) {
@@ -281,7 +780,7 @@ void writeToTXBuffer(u_char s, u_char *array, u_int length) {
 	_tx_wr_cache[s] = addr;
 }
 
-void writeToTXBufferPiecemeal(u_char s, u_char *array, u_int length) {
+WIZ_RAMFUNC void writeToTXBufferPiecemeal(u_char s, u_char *array, u_int length) {
 	u_int addr;
 	if (length == 0) {
 		return;
@@ -293,7 +792,53 @@ void writeToTXBufferPiecemeal(u_char s, u_char *array, u_int length) {
 	_tx_wr_cache[s] = addr;
 }
 
-void fillTXBufferPiecemeal(u_char s, u_char value, u_int length) {
+/**
+ * piecemeal write of a buffer/fill list, one SPI frame and a single Sn_TX_WR commit.
+ * Returns the bytes written, 0 without writing anything when they don't fit
+ * the TX memory left behind data not yet sent.
+ */
+WIZ_RAMFUNC u_int writeToTXBufferVector(u_char s, const SPIVector *vector, u_char count) {
+	u_int addr, length = 0;
+	u_char c;
+
+	for (c = 0; c < count; c++) {
+		length += vector[c].length;
+	}
+	if (length == 0 || length > getTXVirtualFreeSize(s)) {
+		return 0;
+	}
+	addr = _tx_wr_cache[s];
+	writeMemoryVector(addr, _socket_txb_block[s], vector, count);
+	addr += length;
+	setSn_TX_WR(s, addr);
+	_tx_wr_cache[s] = addr;
+	return length;
+}
+
+/**
+ * queue the TX buffer write and the Sn_TX_WR update behind it and return,
+ * so the next response can be built while this one is on the wire
+ */
+WIZ_RAMFUNC void writeToTXBufferPiecemealAsync(u_char s, u_char *array, u_int length,
+		SPITransaction *transaction) {
+	u_int addr;
+	if (length == 0) {
+		return;
+	}
+	// pointer update transaction from the previous call may still be queued
+	waitSPITransaction(&_tx_wr_transaction[s]);
+	addr = _tx_wr_cache[s];
+	writeMemoryArrayAsync(addr, _socket_txb_block[s], array, length,
+			transaction, 0);
+	addr += length;
+	htons(addr, _tx_wr_bytes[s]);
+	setupSPITransaction(&_tx_wr_transaction[s], Sn_TX_WR, _socket_reg_block[s],
+			SPI_WRITE, _tx_wr_bytes[s], 2);
+	submitSPITransaction(&_tx_wr_transaction[s]);
+	_tx_wr_cache[s] = addr;
+}
+
+WIZ_RAMFUNC void fillTXBufferPiecemeal(u_char s, u_char value, u_int length) {
 	u_int addr;
 	if (length == 0) {
 		return;
@@ -317,7 +862,7 @@ void readFromRXBuffer(u_char s, u_char *array, u_int length) {
 	_rx_rd_cache[s] = addr;
 }
 
-void readFromRXBufferPiecemeal(u_char s, u_char *array, u_int length) {
+WIZ_RAMFUNC void readFromRXBufferPiecemeal(u_char s, u_char *array, u_int length) {
 	u_int addr = 0;
 	if (length == 0) {
 		return;
@@ -329,7 +874,7 @@ void readFromRXBufferPiecemeal(u_char s, u_char *array, u_int length) {
 	_rx_rd_cache[s] = addr;
 }
 
-void flushRXBufferPiecemeal(u_char s, u_int length) {
+WIZ_RAMFUNC void flushRXBufferPiecemeal(u_char s, u_int length) {
 	u_int addr = 0;
 	if (length == 0) {
 		return;
@@ -343,6 +888,8 @@ void flushRXBufferPiecemeal(u_char s, u_int length) {
 
 void refreshTXBufferCache(u_char s) {
 	_tx_wr_cache[s] = getSn_TX_WR(s);
+	_tx_sent[s] = _tx_wr_cache[s];
+	_send_pending &= ~(1 << s);
 }
 
 void refreshRXBufferCache(u_char s) {
@@ -351,38 +898,61 @@ void refreshRXBufferCache(u_char s) {
 
 /**
  * copy local buffer to W5500 and send data
+ *
+ * polling loops read the socket block once per pass. Sn_TX_FSR only grows
+ * while we wait, so a burst read can under- but never over-report it.
+ * Returns 4 without sending when length exceeds the socket's TX memory,
+ * the caller has to split such writes.
  */
 u_int send(u_char s, const u_char * buffer, u_int * length, u_char retry) {
 	u_char status = 0; // TODO define statuses
 	u_int txPointerBefore, txPointerAfter;
+	SocketSnapshot *snapshot;
 
+	// a streamed SEND may still be out, its SEND_OK would end the wait below early
+	if (!waitSendComplete(s)) {
+		return 3;
+	}
 	if (!retry) {
+		// more than the socket's TX memory would never fit
+		if (*length > getSocketTXSize(s)) {
+			return 4;
+		}
 		do {
-			status = getSn_SR(s);
+			snapshot = snapshotSocket(s, SNAPSHOT_REFRESH);
+			status = snapshot->sr;
 			if ((status != SOCK_ESTABLISHED) && (status != SOCK_CLOSE_WAIT)) {
 				return 2;
 			}
-		} while (getTXFreeSize(s) < *length);
+		} while (ntohs(snapshot->tx_fsr) < *length);
 
 		writeToTXBuffer(s, (u_char *) buffer, *length);
+		txPointerBefore = ntohs(snapshot->tx_rd); // TX_RD doesn't move without a SEND
+	} else {
+		txPointerBefore = getSn_TX_RD(s);
 	}
 
-	txPointerBefore = getSn_TX_RD(s);
-
 	setSn_CR(s, Sn_CR_SEND);
 	while (getSn_CR(s))
 		;
 
-	while ((getSn_IR(s) & Sn_IR_SEND_OK) != Sn_IR_SEND_OK) {
-		if (getSn_IR(s) == SOCK_CLOSED) {
+	while (1) {
+		snapshot = snapshotSocket(s, SNAPSHOT_REFRESH);
+		if (snapshot->ir & Sn_IR_SEND_OK) {
+			break;
+		}
+		if (snapshot->sr == SOCK_CLOSED) {
 			close_s(s);
 			return 3;
 		}
 	}
 	setSn_IR(s, Sn_IR_SEND_OK); // wasn't SEND_OK set already internally?
+	invalidateSocketSnapshot(s);
 
-	txPointerAfter = getSn_TX_RD(s);
-	refreshTXBufferCache(s);
+	// TX_RD and TX_WR are settled once SEND_OK is up, take them from the last snapshot
+	txPointerAfter = ntohs(snapshot->tx_rd);
+	_tx_wr_cache[s] = ntohs(snapshot->tx_wr);
+	_tx_sent[s] = _tx_wr_cache[s];
 
 	*length = txPointerAfter - txPointerBefore;
 	if (txPointerAfter > txPointerBefore) {
@@ -393,12 +963,97 @@ u_int send(u_char s, const u_char * buffer, u_int * length, u_char retry) {
 }
 
 
+/*
+ * Wait for SEND_OK of a streamed SEND, returns 0 if the socket closed instead
+ */
+u_char waitSendComplete(u_char s) {
+	u_int irsr;
+
+	if (!(_send_pending & (1 << s)))
+		return 1;
+	// Sn_IR and Sn_SR are adjacent, one word read covers both
+	while (!((irsr = wizReadWord(Sn_IR, WIZ_Sn_REG(s))) & (Sn_IR_SEND_OK << 8))) {
+		if ((irsr & 0xFF) == SOCK_CLOSED) {
+			_send_pending &= ~(1 << s);
+			return 0;
+		}
+	}
+	setSn_IR(s, Sn_IR_SEND_OK);
+	_send_pending &= ~(1 << s);
+	return 1;
+}
+
+static u_int txFree(SocketSnapshot *snapshot, u_char s);
+
+/*
+ * SEND everything written past the last SEND once that one is out,
+ * returns 0 if the socket closed instead
+ */
+static u_char sendPending(u_char s) {
+	if (((_tx_wr_cache[s] ^ _tx_sent[s]) & 0xFFFF) == 0)
+		return 1;
+	if (!waitSendComplete(s))
+		return 0;
+	setSn_CR(s, Sn_CR_SEND);
+	invalidateSocketSnapshot(s);
+	_tx_sent[s] = _tx_wr_cache[s];
+	_send_pending |= 1 << s;
+	return 1;
+}
+
+/*
+ * Pipelined send: copies into free TX memory while the previous SEND is still
+ * going out and issues the next SEND as soon as its SEND_OK is in. Returns
+ * without waiting for the last SEND, call waitSendComplete before DISCON/CLOSE.
+ * Data already written past the last SEND (vector writes) goes out with it
+ * and is counted against the free space, length 0 only sends that.
+ * Returns 1 on success, 2 if the socket isn't connected, 3 if it closed.
+ */
+u_char sendStream(u_char s, const u_char * buffer, u_int length) {
+	SocketSnapshot *snapshot;
+	u_int space, chunk, want;
+
+	if (getSocketTXSize(s) == 0) {
+		return 2;
+	}
+	do {
+		// wait until half the TX memory (or the rest of the data) is free, so
+		// one half fills while the other is on the wire
+		want = getSocketTXSize(s) >> 1;
+		if (length < want) {
+			want = length;
+		}
+		do {
+			snapshot = snapshotSocket(s, SNAPSHOT_REFRESH);
+			if (snapshot->sr != SOCK_ESTABLISHED && snapshot->sr != SOCK_CLOSE_WAIT) {
+				return 2;
+			}
+			space = txFree(snapshot, s);
+			// unsent data holding the room only leaves with a SEND
+			if (space < want && !sendPending(s)) {
+				return 3;
+			}
+		} while (space < want);
+
+		chunk = length < space ? length : space;
+		writeToTXBufferPiecemeal(s, (u_char *) buffer, chunk);
+		buffer += chunk;
+		length -= chunk;
+
+		if (!sendPending(s)) {
+			return 3;
+		}
+	} while (length);
+	return 1;
+}
+
 /**
  * copy received data from W5500's RX buffer to the local buffer
  */
 void receive(u_char s, u_char * buffer, u_int length) {
 	readFromRXBuffer(s, buffer, length);
 	setSn_CR(s, Sn_CR_RECV);
+	invalidateSocketSnapshot(s);
 	while (getSn_CR(s))
 		;
 }
@@ -410,51 +1065,106 @@ void clearBuffer(u_char* array, u_int length) {
 	}
 }
 
+/*
+ * Ring view of a socket's TX/RX memory. Chip pointers come from the socket
+ * snapshot, which is only re-read after a command or an event invalidated it;
+ * our side is _tx_wr_cache/_rx_rd_cache. A stale snapshot can only under-report
+ * free space and received data, so a cached 0 is re-read before it is believed.
+ * Pointers are 16 bit and wrap freely, the chip masks them with the buffer size.
+ */
+static SocketSnapshot *ringSnapshot(u_char s, u_char reuse) {
+	SocketSnapshot *snapshot = snapshotSocket(s, reuse);
+	u_char retry = 3;
+
+	// RSR and the RX pointers come from one burst, a mismatch means the chip updated mid-read
+	while (retry-- && ntohs(snapshot->rx_rsr)
+			!= ((ntohs(snapshot->rx_wr) - ntohs(snapshot->rx_rd)) & 0xFFFF)) {
+		snapshot = snapshotSocket(s, SNAPSHOT_REFRESH);
+	}
+	return snapshot;
+}
+
+static u_int txFree(SocketSnapshot *snapshot, u_char s) {
+	u_int space = ntohs(snapshot->tx_fsr);
+	u_int unsent = (_tx_wr_cache[s] - _tx_sent[s]) & 0xFFFF;
+
+	return unsent < space ? space - unsent : 0;
+}
+
+/*
+ * Chip's Sn_TX_FSR
+ */
 u_int getTXFreeSize(u_char s) {
-	u_int firstRead = 0, secondRead = 0;
-	do {
-		secondRead = getSn_TX_FSR(s);
-		if (secondRead != 0) {
-			firstRead = getSn_TX_FSR(s);
-		}
-	} while (firstRead != secondRead);
-	return firstRead;
+	u_int space = ntohs(ringSnapshot(s, SNAPSHOT_REUSE)->tx_fsr);
+
+	if (space == 0) {
+		space = ntohs(ringSnapshot(s, SNAPSHOT_REFRESH)->tx_fsr);
+	}
+	return space;
 }
 
+/*
+ * Free TX memory after data written past the last SEND, which Sn_TX_FSR doesn't count yet
+ */
 u_int getTXVirtualFreeSize(u_char s) {
-	u_int firstRead = 0, secondRead = 0;
-	do {
-		secondRead = getSn_TX_RD(s);
-		if (secondRead != 0) {
-			firstRead = getSn_TX_RD(s);
-		}
-	} while (firstRead != secondRead);
+	u_int space = txFree(ringSnapshot(s, SNAPSHOT_REUSE), s);
 
-	if (firstRead == _tx_wr_cache[s])
-		return 65535;
-	return firstRead - _tx_wr_cache[s];
+	if (space == 0) {
+		space = txFree(ringSnapshot(s, SNAPSHOT_REFRESH), s);
+	}
+	return space;
 }
 
+/*
+ * Chip's Sn_RX_RSR, bytes received since the last RECV
+ */
 u_int getRXReceived(u_char s) {
-	u_int firstRead = 0, secondRead = 0;
-	do {
-		secondRead = getSn_RX_RSR(s);
-		if (secondRead != 0) {
-			firstRead = getSn_RX_RSR(s);
-		}
-	} while (firstRead != secondRead);
-	return firstRead;
+	u_int received = ntohs(ringSnapshot(s, SNAPSHOT_REUSE)->rx_rsr);
+
+	if (received == 0) {
+		received = ntohs(ringSnapshot(s, SNAPSHOT_REFRESH)->rx_rsr);
+	}
+	return received;
 }
 
+/*
+ * Received bytes not yet read piecemeal
+ */
 u_int getVirtualRXReceived(u_char s) {
-	u_int firstRead = 0, secondRead = 0;
-	do {
-		secondRead = getSn_RX_WR(s);
-		if (secondRead != 0) {
-			firstRead = getSn_RX_WR(s);
-		}
-	} while (firstRead != secondRead);
-	return firstRead - _rx_rd_cache[s];
+	u_int received = (ntohs(ringSnapshot(s, SNAPSHOT_REUSE)->rx_wr) - _rx_rd_cache[s]) & 0xFFFF;
+
+	if (received == 0) {
+		received = (ntohs(ringSnapshot(s, SNAPSHOT_REFRESH)->rx_wr) - _rx_rd_cache[s]) & 0xFFFF;
+	}
+	return received;
+}
+
+/*
+ * Free TX bytes from the write pointer up to the physical end of the socket's TX memory
+ */
+u_int getTXContiguousSpan(u_char s) {
+	u_int size = getSocketTXSize(s);
+	u_int space = getTXVirtualFreeSize(s);
+	u_int span;
+
+	if (size == 0)
+		return 0;
+	span = size - (_tx_wr_cache[s] & (size - 1));
+	return span < space ? span : space;
+}
+
+/*
+ * Unread RX bytes from the read pointer up to the physical end of the socket's RX memory
+ */
+u_int getRXContiguousSpan(u_char s) {
+	u_int size = getSocketRXSize(s);
+	u_int received = getVirtualRXReceived(s);
+	u_int span;
+
+	if (size == 0)
+		return 0;
+	span = size - (_rx_rd_cache[s] & (size - 1));
+	return span < received ? span : received;
 }
 
 u_int ntohs(u_char *array) {
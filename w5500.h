@@ -9,6 +9,7 @@
 #define W5500_H_
 
 #include "typedefs.h"
+#include "wizspi.h"
 
 extern volatile unsigned int dbg_txwr, dbg_rxrd;
 
@@ -31,6 +32,8 @@ extern const u_char _socket_rxb_block[];
 #define OP_FDM_2_BYTE	0x02
 #define OP_FDM_4_BYTE	0x03
 
+#include "wizreg.h" // inline accessors need the defines above
+
 // common register block
 #define MR				0x00	// Mode
 #define GAR				0x01	// Gateway Address
@@ -53,6 +56,7 @@ extern const u_char _socket_rxb_block[];
 #define UPORTR			0x2C	// Unreachable Port
 #define PHYCFGR			0x2E	// PHY Configuration
 #define VERSIONR		0x39	// Chip Version
+#define VERSIONR_W5500	0x04	// value read back from a W5500
 // socket register block
 #define Sn_MR			0x00	// Socket n Mode
 #define Sn_CR			0x01	// Socket n Command
@@ -169,6 +173,44 @@ extern const u_char _socket_rxb_block[];
 #define IPPROTO_ND                   77
 #define IPPROTO_RAW                  0xFF
 
+/*
+ * Socket register block 0x00-0x2F as read in one burst.
+ * Multi-byte registers are big-endian, use ntohs() on the word fields.
+ */
+typedef struct {
+	u_char mr;				// 0x00
+	u_char cr;				// 0x01
+	u_char ir;				// 0x02
+	u_char sr;				// 0x03
+	u_char port[2];			// 0x04
+	u_char dhar[6];			// 0x06
+	u_char dipr[4];			// 0x0C
+	u_char dport[2];		// 0x10
+	u_char mssr[2];			// 0x12
+	u_char reserved0;		// 0x14
+	u_char tos;				// 0x15
+	u_char ttl;				// 0x16
+	u_char reserved1[7];	// 0x17
+	u_char rxbuf_size;		// 0x1E
+	u_char txbuf_size;		// 0x1F
+	u_char tx_fsr[2];		// 0x20
+	u_char tx_rd[2];		// 0x22
+	u_char tx_wr[2];		// 0x24
+	u_char rx_rsr[2];		// 0x26
+	u_char rx_rd[2];		// 0x28
+	u_char rx_wr[2];		// 0x2A
+	u_char imr;				// 0x2C
+	u_char frag[2];			// 0x2D
+	u_char kpalvtr;			// 0x2F
+} SocketSnapshot;
+
+#define SOCKET_SNAPSHOT_SIZE	0x30
+#define SNAPSHOT_REFRESH		0x00	// always read the block
+#define SNAPSHOT_REUSE			0x01	// use the last snapshot if it is still valid
+
+SocketSnapshot *snapshotSocket(u_char s, u_char reuse);
+void invalidateSocketSnapshot(u_char s);
+
 void waitUntilSocketClosed(u_char s);			// loop until socket is closed
 void openSocketOnPort(u_char s, u_char port);// same as socket but waits until socket is opened
 void startListening(u_char s);		// same as listen but waits until listening
@@ -179,6 +221,82 @@ void disconnect(u_char s);										// disconnect
 void listen(u_char s);
 void receive(u_char s, u_char * buffer, u_int length);
 u_int send(u_char s, const u_char * buffer, u_int * length, u_char retry);
+u_char sendStream(u_char s, const u_char * buffer, u_int length);
+u_char waitSendComplete(u_char s);
+
+// streaming RX cursor, maps a window of the RX ring into RAM, one RECV per commit
+typedef struct {
+	u_char socket;
+	u_char *buffer;
+	u_int size;			// window capacity
+	u_int length;		// bytes in the window
+	u_int position;		// next byte in the window
+	u_int remaining;	// received bytes not mapped yet
+	u_int consumed;		// bytes taken off the ring since open
+} RXCursor;
+
+void openRXCursor(RXCursor *cursor, u_char s, u_char *buffer, u_int size);
+u_char nextRXByte(RXCursor *cursor, u_char *byte);
+void commitRXCursor(RXCursor *cursor);
+void rewindRXCursor(RXCursor *cursor);
+u_char isRXCursorDrained(RXCursor *cursor);
+
+// UDP datagram reader, walks every queued datagram and releases them with one RECV
+typedef struct {
+	u_char socket;
+	u_char addr[4];		// source of the current datagram
+	u_int port;
+	u_int length;		// payload length of the current datagram
+	u_int remaining;	// received bytes past the current datagram
+	u_int next;			// ring pointer of the next header
+	u_int count;		// datagrams walked since the last commit, a 2 KB ring holds 256 empty ones
+} DatagramReader;
+
+u_int openDatagrams(DatagramReader *reader, u_char s);
+u_char nextDatagram(DatagramReader *reader);
+u_int readDatagram(DatagramReader *reader, u_char *buffer, u_int length);
+void commitDatagrams(DatagramReader *reader);
+u_int recvfrom(u_char s, u_char *buffer, u_int length, u_char *addr, u_int *port);
+u_char sendto(u_char s, const u_char *buffer, u_int length, u_char *addr, u_int port);
+u_char nextFrame(DatagramReader *reader);	// MACRAW, in place of nextDatagram
+u_char sendFrame(u_char s, const u_char *frame, u_int length);
+
+// socket memory partition, sizes in KB: 0, 1, 2, 4, 8 or 16, at most 16 KB per direction
+typedef struct {
+	u_char tx[8];
+	u_char rx[8];
+} MemoryProfile;
+
+#define SOCKET_MEMORY_TOTAL		16
+
+u_char applyMemoryProfile(const MemoryProfile *profile);
+u_int getSocketTXSize(u_char s);
+u_int getSocketRXSize(u_char s);
+
+// non-blocking socket commands, one in flight per socket
+#define CMD_IDLE				0x00
+#define CMD_ISSUED				0x01	// waiting for Sn_CR to clear
+#define CMD_WAIT_STATUS			0x02	// accepted, waiting for the target Sn_SR
+#define CMD_DONE				0x03
+#define CMD_FAILED				0x04	// socket closed before reaching the target status, or superseded
+#define CMD_TIMEOUT				0x05
+
+#define SOCK_ANY				0xFF	// target status: done once Sn_CR clears
+
+typedef void (*SocketCommandCallback)(u_char s, u_char result);
+
+void issueSocketCommand(u_char s, u_char command, u_char status, u_int timeout,
+		SocketCommandCallback callback);
+u_char pollSocketCommand(u_char s);
+void pollSocketCommands(void);
+u_char isSocketCommandBusy(u_char s);
+void socketAsync(u_char s, u_char protocol, u_int port, u_char flag,
+		SocketCommandCallback callback);
+void listenAsync(u_char s, SocketCommandCallback callback);
+void connectAsync(u_char s, u_char * addr, u_int port,
+		SocketCommandCallback callback);
+void disconnectAsync(u_char s, SocketCommandCallback callback);
+void closeAsync(u_char s, SocketCommandCallback callback);
 
 // register read & write
 u_char readRegisterByte(u_char offset, u_char control);
@@ -195,9 +313,16 @@ void writeMemoryByte(u_int addr, u_char control, u_char byte);
 void readMemoryArray(u_int addr, u_char control, u_char* array, u_int length);
 void writeMemoryArray(u_int addr, u_char control, u_char* array, u_int length);
 void fillMemoryArray(u_int addr, u_char control, u_char value, u_int length);
+void writeMemoryVector(u_int addr, u_char control, const SPIVector *vector,
+		u_char count);
+void writeMemoryArrayAsync(u_int addr, u_char control, u_char* array,
+		u_int length, SPITransaction *transaction, SPICallback callback);
 void writeToTXBuffer(u_char s, u_char* array, u_int length);
 void writeToTXBufferPiecemeal(u_char s, u_char* array, u_int length);
+void writeToTXBufferPiecemealAsync(u_char s, u_char* array, u_int length,
+		SPITransaction *transaction);
 void fillTXBufferPiecemeal(u_char s, u_char value, u_int length);
+u_int writeToTXBufferVector(u_char s, const SPIVector *vector, u_char count);
 void readFromRXBuffer(u_char s, u_char* array, u_int length);
 void readFromRXBufferPiecemeal(u_char s, u_char* array, u_int length);
 void flushRXBufferPiecemeal(u_char s, u_int length);
@@ -207,6 +332,8 @@ u_int getTXFreeSize(u_char s);
 u_int getTXVirtualFreeSize(u_char s);
 u_int getRXReceived(u_char s);
 u_int getVirtualRXReceived(u_char s);
+u_int getTXContiguousSpan(u_char s);
+u_int getRXContiguousSpan(u_char s);
 
 u_int ntohs(u_char *array);
 void htons(u_int val, u_char *array);
@@ -214,80 +341,92 @@ void htons(u_int val, u_char *array);
 void refreshTXBufferCache(u_char s);
 void refreshRXBufferCache(u_char s);
 
+// write-through shadow of configuration registers only we change
+void writeShadowedRegister(u_char offset, u_char control, u_char* array,
+		u_int length);
+void readShadowedRegister(u_char offset, u_char control, u_char* array,
+		u_int length);
+void writeShadowedByte(u_char offset, u_char control, u_char byte);
+u_char readShadowedByte(u_char offset, u_char control);
+void writeShadowedWord(u_char offset, u_char control, u_int word);
+u_int readShadowedWord(u_char offset, u_char control);
+void invalidateRegisterShadow(void);
+void writeModeRegister(u_char mr);
+
 // common register functions
-#define setMR(mr)				writeRegisterByte(MR, 0, mr)
-#define getMR()					readRegisterByte(MR, 0)
-#define setGAR(gar)				writeRegisterArray(GAR, 0, gar, 4)
-#define getGAR(gar)				readRegisterArray(GAR, 0, gar, 4)
-#define setSUBR(subr)			writeRegisterArray(SUBR, 0, subr, 4)
-#define getSUBR(subr)			readRegisterArray(SUBR, 0, subr, 4)
-#define setSHAR(shar)			writeRegisterArray(SHAR, 0, shar, 6)
-#define getSHAR(shar)			readRegisterArray(SHAR, 0, shar, 6)
-#define setSIPR(sipr)			writeRegisterArray(SIPR, 0, sipr, 4)
-#define getSIPR(sipr)			readRegisterArray(SIPR, 0, sipr, 4)
-#define setINTLEVEL(intlevel)	writeRegisterWord(INTLEVEL, 0, intlevel)
-#define getINTLEVEL()			readRegisterWord(INTLEVEL, 0)
-#define setIR(ir)				writeRegisterByte(IR, 0, (ir & 0xF0)) // mask reserved bits
-#define getIR()					readRegisterByte(IR, 0) // lower bits are reserved
-#define setIMR(imr)				writeRegisterByte(IMR, 0, (imr & 0xF0))  // mask reserved bits
-#define getIMR()				readRegisterByte(IMR, 0)
-#define setSIR(sir)				writeRegisterByte(SIR, 0, sir)
-#define getSIR()				readRegisterByte(SIR, 0)
-#define setSIMR(simr)			writeRegisterByte(SIMR, 0, simr)
-#define getSIMR()				readRegisterByte(SIMR, 0)
-#define setRTR(rtr)				writeRegisterWord(RTR, 0, rtr)
-#define getRTR()				readRegisterWord(RTR, 0)
-#define setRCR(rcr)				writeRegisterByte(RCR, 0, rcr)
-#define getRCR()				readRegisterByte(RCR, 0)
+#define setMR(mr)				writeModeRegister(mr) // MR_RST drops the shadow
+#define getMR()					wizReadByte(MR, COMM_REG_BLOCK)
+#define setGAR(gar)				writeShadowedRegister(GAR, 0, gar, 4)
+#define getGAR(gar)				readShadowedRegister(GAR, 0, gar, 4)
+#define setSUBR(subr)			writeShadowedRegister(SUBR, 0, subr, 4)
+#define getSUBR(subr)			readShadowedRegister(SUBR, 0, subr, 4)
+#define setSHAR(shar)			writeShadowedRegister(SHAR, 0, shar, 6)
+#define getSHAR(shar)			readShadowedRegister(SHAR, 0, shar, 6)
+#define setSIPR(sipr)			writeShadowedRegister(SIPR, 0, sipr, 4)
+#define getSIPR(sipr)			readShadowedRegister(SIPR, 0, sipr, 4)
+#define setINTLEVEL(intlevel)	wizWriteWord(INTLEVEL, COMM_REG_BLOCK, intlevel)
+#define getINTLEVEL()			wizReadWord(INTLEVEL, COMM_REG_BLOCK)
+#define setIR(ir)				wizWriteByte(IR, COMM_REG_BLOCK, (ir & 0xF0)) // mask reserved bits
+#define getIR()					wizReadByte(IR, COMM_REG_BLOCK) // lower bits are reserved
+#define setIMR(imr)				wizWriteByte(IMR, COMM_REG_BLOCK, (imr & 0xF0))  // mask reserved bits
+#define getIMR()				wizReadByte(IMR, COMM_REG_BLOCK)
+#define setSIR(sir)				wizWriteByte(SIR, COMM_REG_BLOCK, sir)
+#define getSIR()				wizReadByte(SIR, COMM_REG_BLOCK)
+#define setSIMR(simr)			wizWriteByte(SIMR, COMM_REG_BLOCK, simr)
+#define getSIMR()				wizReadByte(SIMR, COMM_REG_BLOCK)
+#define setRTR(rtr)				wizWriteWord(RTR, COMM_REG_BLOCK, rtr)
+#define getRTR()				wizReadWord(RTR, COMM_REG_BLOCK)
+#define setRCR(rcr)				wizWriteByte(RCR, COMM_REG_BLOCK, rcr)
+#define getRCR()				wizReadByte(RCR, COMM_REG_BLOCK)
 #define getUIPR(uipr)			readRegisterArray(UIPR, 0, uipr, 6)
-#define getUPORTR()				readRegisterWord(UPORTR, 0)
-#define setPHYCFGR(phycfgr)		writeRegisterByte(PHYCFGR, 0, phycfgr)
-#define getPHYCFGR()			readRegisterByte(PHYCFGR, 0)
-#define getVERSIONR()			readRegisterByte(VERSIONR, 0)
+#define getUPORTR()				wizReadWord(UPORTR, COMM_REG_BLOCK)
+#define setPHYCFGR(phycfgr)		wizWriteByte(PHYCFGR, COMM_REG_BLOCK, phycfgr)
+#define getPHYCFGR()			wizReadByte(PHYCFGR, COMM_REG_BLOCK)
+#define getVERSIONR()			wizReadByte(VERSIONR, COMM_REG_BLOCK)
 
 // socket register functions
-#define setSn_MR(s, mr)			writeRegisterByte(Sn_MR, _socket_reg_block[s], mr)
-#define getSn_MR(s)				readRegisterByte(Sn_MR, _socket_reg_block[s])
-#define setSn_CR(s, cr)			writeRegisterByte(Sn_CR, _socket_reg_block[s], cr)
-#define getSn_CR(s)				readRegisterByte(Sn_CR, _socket_reg_block[s])
-#define setSn_IR(s, ir)			writeRegisterByte(Sn_IR, _socket_reg_block[s], (ir & 0x1F))  // mask reserved bits
-#define getSn_IR(s)				readRegisterByte(Sn_IR, _socket_reg_block[s])
-#define setSn_IMR(s, imr)		writeRegisterByte(Sn_IMR, _socket_reg_block[s], (imr & 0x1F)) // mask reserved bits
-#define getSn_IMR(s)			readRegisterByte(Sn_IMR, _socket_reg_block[s]) // upper bits are reserved
+#define setSn_MR(s, mr)			writeShadowedByte(Sn_MR, _socket_reg_block[s], mr)
+#define getSn_MR(s)				readShadowedByte(Sn_MR, _socket_reg_block[s])
+#define setSn_CR(s, cr)			wizWriteByte(Sn_CR, WIZ_Sn_REG(s), cr)
+#define getSn_CR(s)				wizReadByte(Sn_CR, WIZ_Sn_REG(s))
+#define setSn_IR(s, ir)			wizWriteByte(Sn_IR, WIZ_Sn_REG(s), (ir & 0x1F))  // mask reserved bits
+#define getSn_IR(s)				wizReadByte(Sn_IR, WIZ_Sn_REG(s))
+#define setSn_IMR(s, imr)		wizWriteByte(Sn_IMR, WIZ_Sn_REG(s), (imr & 0x1F)) // mask reserved bits
+#define getSn_IMR(s)			wizReadByte(Sn_IMR, WIZ_Sn_REG(s)) // upper bits are reserved
 //
-#define getSn_SR(s)				readRegisterByte(Sn_SR, _socket_reg_block[s])
-#define setSn_PORT(s, port)		writeRegisterWord(Sn_PORT, _socket_reg_block[s], port)
-#define getSn_PORT(s)			readRegisterWord(Sn_PORT, _socket_reg_block[s])
+#define getSn_SR(s)				wizReadByte(Sn_SR, WIZ_Sn_REG(s))
+#define setSn_PORT(s, port)		writeShadowedWord(Sn_PORT, _socket_reg_block[s], port)
+#define getSn_PORT(s)			readShadowedWord(Sn_PORT, _socket_reg_block[s])
 #define setSn_DHAR(s, dhar)		writeRegisterArray(Sn_DHAR, _socket_reg_block[s], dhar, 6)
 #define getSn_DHAR(s, dhar)		readRegisterArray(Sn_DHAR, _socket_reg_block[s], dhar, 6)
-#define setSn_DIPR(s, dipr)		writeRegisterArray(Sn_DIPR, _socket_reg_block[s], dipr, 4)
-#define getSn_DIPR(s, dipr)		readRegisterArray(Sn_DIPR, _socket_reg_block[s], dipr, 4)
-#define setSn_DPORT(s, dport)	writeRegisterWord(Sn_DPORT, _socket_reg_block[s], dport)
-#define getSn_DPORT(s)			readRegisterWord(Sn_DPORT, _socket_reg_block[s])
-#define setSn_MSSR(s, mss)		writeRegisterWord(Sn_MSSR, _socket_reg_block[s], mss)
-#define getSn_MSSR(s)			readRegisterWord(Sn_MSSR, _socket_reg_block[s])
-#define setSn_TOS(s, tos)		writeRegisterByte(Sn_TOS, _socket_reg_block[s], tos)
-#define getSn_TOS(s)			readRegisterByte(Sn_TOS, _socket_reg_block[s])
-#define setSn_TTL(s, ttl)		writeRegisterByte(Sn_TTL, _socket_reg_block[s], ttl)
-#define getSn_TTL(s)			readRegisterByte(Sn_TTL, _socket_reg_block[s])
-#define setSn_RXBUF_SIZE(s, rxbufsize)	writeRegisterByte(Sn_RXBUF_SIZE, _socket_reg_block[s], rxbufsize)
-#define getSn_RXBUF_SIZE(s)		readRegisterByte(Sn_RXBUF_SIZE, _socket_reg_block[s])
-#define setSn_TXBUF_SIZE(s, txbufsize)	writeRegisterByte(Sn_TXBUF_SIZE, _socket_reg_block[s], txbufsize)
-#define getSn_TXBUF_SIZE(s)		readRegisterByte(Sn_TXBUF_SIZE, _socket_reg_block[s])
-#define setSn_RX_RD(s, rxrd)	writeRegisterWord(Sn_RX_RD, _socket_reg_block[s], rxrd)
-#define getSn_RX_RD(s)			readRegisterWord(Sn_RX_RD, _socket_reg_block[s])
-#define getSn_TX_FSR(s)			readRegisterWord(Sn_TX_FSR, _socket_reg_block[s])
-#define getSn_RX_RSR(s)			readRegisterWord(Sn_RX_RSR, _socket_reg_block[s])
+#define setSn_DIPR(s, dipr)		writeShadowedRegister(Sn_DIPR, _socket_reg_block[s], dipr, 4)
+#define getSn_DIPR(s, dipr)		readShadowedRegister(Sn_DIPR, _socket_reg_block[s], dipr, 4) // TCP: chip fills in the peer
+#define setSn_DPORT(s, dport)	writeShadowedWord(Sn_DPORT, _socket_reg_block[s], dport)
+#define getSn_DPORT(s)			readShadowedWord(Sn_DPORT, _socket_reg_block[s])
+#define setSn_MSSR(s, mss)		wizWriteWord(Sn_MSSR, WIZ_Sn_REG(s), mss)
+#define getSn_MSSR(s)			wizReadWord(Sn_MSSR, WIZ_Sn_REG(s))
+#define setSn_TOS(s, tos)		wizWriteByte(Sn_TOS, WIZ_Sn_REG(s), tos)
+#define getSn_TOS(s)			wizReadByte(Sn_TOS, WIZ_Sn_REG(s))
+#define setSn_TTL(s, ttl)		wizWriteByte(Sn_TTL, WIZ_Sn_REG(s), ttl)
+#define getSn_TTL(s)			wizReadByte(Sn_TTL, WIZ_Sn_REG(s))
+#define setSn_RXBUF_SIZE(s, rxbufsize)	writeShadowedByte(Sn_RXBUF_SIZE, _socket_reg_block[s], rxbufsize)
+#define getSn_RXBUF_SIZE(s)		readShadowedByte(Sn_RXBUF_SIZE, _socket_reg_block[s])
+#define setSn_TXBUF_SIZE(s, txbufsize)	writeShadowedByte(Sn_TXBUF_SIZE, _socket_reg_block[s], txbufsize)
+#define getSn_TXBUF_SIZE(s)		readShadowedByte(Sn_TXBUF_SIZE, _socket_reg_block[s])
+#define setSn_RX_RD(s, rxrd)	wizWriteWord(Sn_RX_RD, WIZ_Sn_REG(s), rxrd)
+#define getSn_RX_RD(s)			wizReadWord(Sn_RX_RD, WIZ_Sn_REG(s))
+#define getSn_TX_FSR(s)			wizReadWord(Sn_TX_FSR, WIZ_Sn_REG(s))
+#define getSn_RX_RSR(s)			wizReadWord(Sn_RX_RSR, WIZ_Sn_REG(s))
 //
-#define getSn_RX_WR(s)			readRegisterWord(Sn_RX_WR, _socket_reg_block[s])
-#define setSn_FRAG(s, frag)		writeRegisterWord(Sn_FRAG, _socket_reg_block[s], frag)
-#define getSn_FRAG(s)			readRegisterWord(Sn_FRAG, _socket_reg_block[s])
-#define setSn_KPALVTR(s, kpalvt)	writeRegisterByte(Sn_KPALVTR, _socket_reg_block[s], kpalvt)
-#define getSn_KPALVTR(s)		readRegisterByte(Sn_KPALVTR, _socket_reg_block[s])
+#define getSn_RX_WR(s)			wizReadWord(Sn_RX_WR, WIZ_Sn_REG(s))
+#define setSn_FRAG(s, frag)		wizWriteWord(Sn_FRAG, WIZ_Sn_REG(s), frag)
+#define getSn_FRAG(s)			wizReadWord(Sn_FRAG, WIZ_Sn_REG(s))
+#define setSn_KPALVTR(s, kpalvt)	wizWriteByte(Sn_KPALVTR, WIZ_Sn_REG(s), kpalvt)
+#define getSn_KPALVTR(s)		wizReadByte(Sn_KPALVTR, WIZ_Sn_REG(s))
 #define getSn_RxMAX(s)			(getSn_RXBUF_SIZE(s) << 10)
 #define getSn_TxMAX(s)			(getSn_TXBUF_SIZE(s) << 10)
-#define getSn_TX_RD(s)			readRegisterWord(Sn_TX_RD, _socket_reg_block[s])
-#define setSn_TX_WR(s, txwr)	writeRegisterWord(Sn_TX_WR, _socket_reg_block[s], txwr)
-#define getSn_TX_WR(s)			readRegisterWord(Sn_TX_WR, _socket_reg_block[s])
+#define getSn_TX_RD(s)			wizReadWord(Sn_TX_RD, WIZ_Sn_REG(s))
+#define setSn_TX_WR(s, txwr)	wizWriteWord(Sn_TX_WR, WIZ_Sn_REG(s), txwr)
+#define getSn_TX_WR(s)			wizReadWord(Sn_TX_WR, WIZ_Sn_REG(s))
 
 #endif /* W5500_H_ */
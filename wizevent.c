@@ -0,0 +1,191 @@
+/*
+ * wizevent.c
+ *
+ * Socket event dispatcher. Each socket registers the Sn_IR bits it cares
+ * about, those are programmed into Sn_IMR/SIMR so INTn only fires for them.
+ * The port interrupt just records that INTn went low; SIR and the flagged
+ * Sn_IR are read and cleared from serviceSocketEvents in main context, since
+ * the SPI queue can't make progress inside a port interrupt.
+ * Bits outside a socket's mask are left in Sn_IR for code that still polls
+ * them (send() waits on SEND_OK that way).
+ *
+ * Without ETH_INTN_PORT, serviceSocketEvents polls SIR on every call and
+ * sleepUntilSocketEvent waits for the next SysTick, so an idle loop reads SIR
+ * once per ms instead of keeping the SPI bus busy.
+ *
+ * The cycle counter is latched when INTn falls (or when a poll first sees
+ * SIR), recordEventLatency measures from there to the caller.
+ */
+
+#include <stdio.h>
+#include "defines.h"
+#include "w5500.h"
+#include "wizevent.h"
+#include "tick.h"
+#include "driverlib.h"
+
+static u_char _socket_event_mask[MAX_SOCK_NUM];
+static SocketEventCallback _socket_event_callback[MAX_SOCK_NUM];
+static u_char _socket_events[MAX_SOCK_NUM];	// dispatched but not yet taken
+static u_char _simr;
+static volatile u_long _event_cycle;	// DWT->CYCCNT when the pending events were signalled
+#ifdef ETH_INTN_PORT
+static volatile u_char _intn_pending;
+#endif
+
+void configureSocketEvents(void) {
+	u_char s;
+
+	setIMR(0x00);
+	setSIMR(0x00);
+	for (s = 0; s < MAX_SOCK_NUM; s++) {
+		setSn_IMR(s, 0x00);	// reset value is 0xFF
+		_socket_event_mask[s] = 0;
+		_socket_event_callback[s] = 0;
+		_socket_events[s] = 0;
+	}
+	_simr = 0;
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+#ifdef ETH_INTN_PORT
+	// INTn is active low and stays low while any unmasked Sn_IR bit is set
+	MAP_GPIO_setAsInputPinWithPullUpResistor(ETH_INTN_PORT, ETH_INTN_PIN);
+	MAP_GPIO_interruptEdgeSelect(ETH_INTN_PORT, ETH_INTN_PIN,
+			GPIO_HIGH_TO_LOW_TRANSITION);
+	MAP_GPIO_clearInterruptFlag(ETH_INTN_PORT, ETH_INTN_PIN);
+	MAP_GPIO_enableInterrupt(ETH_INTN_PORT, ETH_INTN_PIN);
+	Interrupt_enableInterrupt(ETH_INTN_INT);
+#endif
+}
+
+/*
+ * Route mask events of socket s to callback (optional) and the takeSocketEvents accumulator.
+ * Pending events of the mask are dropped, call it before the socket command that starts a session.
+ */
+void setSocketEventHandler(u_char s, u_char mask, SocketEventCallback callback) {
+	_socket_event_mask[s] = mask;
+	_socket_event_callback[s] = callback;
+	_socket_events[s] = 0;
+	setSn_IR(s, mask);
+	setSn_IMR(s, mask);
+	if (mask) {
+		_simr |= 1 << s;
+	} else {
+		_simr &= ~(1 << s);
+	}
+	setSIMR(_simr);
+}
+
+/*
+ * Read SIR and the flagged Sn_IR once, clear and dispatch them. Returns SIR.
+ */
+u_char serviceSocketEvents(void) {
+	u_char sir, ir, s;
+
+#ifdef ETH_INTN_PORT
+	// a level check as well, an edge is missed if INTn never went high between events
+	if (!_intn_pending) {
+		if (MAP_GPIO_getInputPinValue(ETH_INTN_PORT, ETH_INTN_PIN) != GPIO_INPUT_PIN_LOW)
+			return 0;
+		_event_cycle = DWT->CYCCNT;
+	}
+	_intn_pending = 0;
+#endif
+	sir = getSIR() & _simr;
+#ifndef ETH_INTN_PORT
+	if (sir) {
+		_event_cycle = DWT->CYCCNT;
+	}
+#endif
+	for (s = 0; s < MAX_SOCK_NUM; s++) {
+		if (!(sir & (1 << s)))
+			continue;
+		ir = getSn_IR(s) & _socket_event_mask[s];
+		if (!ir)
+			continue;
+		setSn_IR(s, ir);
+		invalidateSocketSnapshot(s); // RECV/SEND_OK moved the ring pointers
+		_socket_events[s] |= ir;
+		if (_socket_event_callback[s]) {
+			_socket_event_callback[s](s, ir);
+		}
+	}
+	return sir;
+}
+
+u_char takeSocketEvents(u_char s, u_char mask) {
+	u_char events = _socket_events[s] & mask;
+
+	_socket_events[s] &= ~events;
+	return events;
+}
+
+/*
+ * Add the cycles from the last INTn edge to now
+ */
+void recordEventLatency(EventLatency *latency) {
+	u_long cycles = DWT->CYCCNT - _event_cycle;
+
+	latency->count++;
+	latency->total += cycles;
+	if (cycles > latency->max) {
+		latency->max = cycles;
+	}
+}
+
+void reportEventLatency(const char *path, const EventLatency *latency) {
+	u_long perUs = MAP_CS_getMCLK() / 1000000;
+
+	printf("%s: %lu frames, INTn to handler avg %lu us, max %lu us\n", path,
+			latency->count, latency->count ? latency->total / latency->count / perUs : 0,
+			latency->max / perUs);
+}
+
+/*
+ * Sleep until one of mask events arrives on socket s, returns and clears them
+ */
+u_char waitSocketEvents(u_char s, u_char mask) {
+	u_char events;
+
+	while (!(events = takeSocketEvents(s, mask))) {
+		if (!serviceSocketEvents()) {
+			sleepUntilSocketEvent();
+		}
+	}
+	return events;
+}
+
+/*
+ * Sleep until INTn has something to service, or until the next tick when polling SIR
+ */
+void sleepUntilSocketEvent(void) {
+#ifndef ETH_INTN_PORT
+	u_long tick = getTick();
+
+	// other interrupts end WFI too, sleep on until SysTick has moved
+	while (getTick() == tick) {
+		CPU_wfi();
+	}
+#else
+	// PRIMASK set: a pending interrupt still ends WFI but can't slip in between check and sleep
+	CPU_cpsid();
+	if (!_intn_pending
+			&& MAP_GPIO_getInputPinValue(ETH_INTN_PORT, ETH_INTN_PIN) != GPIO_INPUT_PIN_LOW) {
+		CPU_wfi();
+	}
+	CPU_cpsie();
+#endif
+}
+
+#ifdef ETH_INTN_PORT
+void ETH_INTN_IRQHandler(void) {
+	uint_fast16_t status = MAP_GPIO_getEnabledInterruptStatus(ETH_INTN_PORT);
+
+	MAP_GPIO_clearInterruptFlag(ETH_INTN_PORT, status);
+	if ((status & ETH_INTN_PIN) && !_intn_pending) {
+		_event_cycle = DWT->CYCCNT;
+		_intn_pending = 1;
+	}
+}
+#endif
@@ -0,0 +1,30 @@
+/*
+ * wizevent.h
+ *
+ * Socket event dispatcher driven by the W5500 INTn pin
+ */
+
+#ifndef WIZEVENT_H_
+#define WIZEVENT_H_
+
+#include "typedefs.h"
+
+typedef void (*SocketEventCallback)(u_char s, u_char events);
+
+// INTn-to-handler time, in cycles
+typedef struct {
+	u_long count;
+	u_long total;
+	u_long max;
+} EventLatency;
+
+void configureSocketEvents(void);
+void setSocketEventHandler(u_char s, u_char mask, SocketEventCallback callback);
+u_char serviceSocketEvents(void);
+u_char takeSocketEvents(u_char s, u_char mask); // fetch and clear
+u_char waitSocketEvents(u_char s, u_char mask);
+void sleepUntilSocketEvent(void);
+void recordEventLatency(EventLatency *latency);
+void reportEventLatency(const char *path, const EventLatency *latency);
+
+#endif /* WIZEVENT_H_ */
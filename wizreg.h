@@ -0,0 +1,112 @@
+/*
+ * wizreg.h
+ *
+ * Header-only W5500 register accessors. Called with a constant offset and
+ * socket, the control byte folds to an immediate and an access is a few
+ * eUSCI register loads and stores, polled with interrupts masked.
+ * Bulk transfers stay on the SPI queue, these wait for it to drain first
+ * so accesses remain ordered behind async writes.
+ *
+ * Included from w5500.h after the block select and SPI mode defines.
+ */
+
+#ifndef WIZREG_H_
+#define WIZREG_H_
+
+#include "defines.h"
+#include "wizspi.h"
+#include "driverlib.h"
+
+// control byte of socket s register block, constant for a constant s
+#define WIZ_Sn_REG(s)			((u_char) (((s) << 5) | REG_BLOCK))
+
+// OM bits, fixed length frames carry the payload length in the header
+#if WIZ_SPI_MODE == WIZ_SPI_FDM
+#define WIZ_OM_BYTE				OP_FDM_1_BYTE
+#define WIZ_OM_WORD				OP_FDM_2_BYTE
+#else
+#define WIZ_OM_BYTE				OP_VDM
+#define WIZ_OM_WORD				OP_VDM
+#endif
+
+/*
+ * Own the bus: queue idle and interrupts masked, returns the previous PRIMASK.
+ * Thread mode only, from a handler the queue could never drain.
+ */
+static inline u_int wizRegBegin(void) {
+	u_int primask;
+
+	WIZ_ASSERT_THREAD();
+	primask = CPU_cpsid();
+
+	while (!isSPIIdle()) {
+		if (!primask) {
+			CPU_cpsie();
+		}
+		waitSPIIdle();
+		primask = CPU_cpsid();
+	}
+	ETH_EUSCI->IFG &= ~EUSCI_A_IFG_RXIFG;
+	wizSelect();
+	return primask;
+}
+
+static inline void wizRegEnd(u_int primask) {
+	wizDeselect();
+	if (!primask) {
+		CPU_cpsie();
+	}
+}
+
+static inline u_char wizExchange(u_char byte) {
+	ETH_EUSCI->TXBUF = byte;
+	while (!(ETH_EUSCI->IFG & EUSCI_A_IFG_RXIFG))
+		;
+	return ETH_EUSCI->RXBUF;
+}
+
+static inline void wizRegHeader(u_char offset, u_char control) {
+	wizExchange(0x00);
+	wizExchange(offset);
+	wizExchange(control);
+}
+
+static inline u_char wizReadByte(u_char offset, u_char control) {
+	u_int primask = wizRegBegin();
+	u_char byte;
+
+	wizRegHeader(offset, control | WIZ_OM_BYTE);
+	byte = wizExchange(0x00);
+	wizRegEnd(primask);
+	return byte;
+}
+
+static inline void wizWriteByte(u_char offset, u_char control, u_char byte) {
+	u_int primask = wizRegBegin();
+
+	wizRegHeader(offset, control | RWB_WRITE | WIZ_OM_BYTE);
+	wizExchange(byte);
+	wizRegEnd(primask);
+}
+
+static inline u_int wizReadWord(u_char offset, u_char control) {
+	u_int primask = wizRegBegin();
+	u_int word;
+
+	wizRegHeader(offset, control | WIZ_OM_WORD);
+	word = wizExchange(0x00) << 8;
+	word |= wizExchange(0x00);
+	wizRegEnd(primask);
+	return word;
+}
+
+static inline void wizWriteWord(u_char offset, u_char control, u_int word) {
+	u_int primask = wizRegBegin();
+
+	wizRegHeader(offset, control | RWB_WRITE | WIZ_OM_WORD);
+	wizExchange(word >> 8);
+	wizExchange(word);
+	wizRegEnd(primask);
+}
+
+#endif /* WIZREG_H_ */
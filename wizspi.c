@@ -0,0 +1,470 @@
+/*
+ * wizspi.c
+ *
+ * Interrupt driven SPI transaction queue for the W5500.
+ *
+ * Transactions are clocked out by the EUSCI_A3 receive interrupt one byte
+ * at a time. Payloads of SPI_DMA_THRESHOLD bytes or more are handed to the
+ * uDMA TX/RX channel pair instead and finish in the DMA_INT1 interrupt.
+ * A vectored transaction streams several buffers and fill runs behind one
+ * header, each segment picking its own path.
+ *
+ * With WIZ_SPI_MODE set to WIZ_SPI_FDM SCSn stays low and the chip counts
+ * bytes instead: every transaction is cut into 4, 2 and 1 byte frames with
+ * their own header, and DMA is not used.
+ *
+ * While interrupts are masked the same state machine is run by polling
+ * from waitSPITransaction, so the queue also works before main enables them.
+ * Submitting and waiting are for thread mode only: inside a handler or a
+ * transaction callback the queue interrupts can't preempt and a wait would
+ * never return, so they assert on IPSR.
+ */
+
+#include "defines.h"
+#include "w5500.h"
+#include "wizspi.h"
+#include "driverlib.h"
+
+#if WIZ_SPI_MODE == WIZ_SPI_VDM
+// 8 channels, primary and alternate structures, table must be aligned to its size
+#ifdef __TI_COMPILER_VERSION__
+#pragma DATA_ALIGN(dmaControlTable, 256)
+DMA_ControlTable dmaControlTable[16];
+#else
+DMA_ControlTable dmaControlTable[16] __attribute__((aligned(256)));
+#endif
+
+static u_char dmaDummy; // sink for discarded RX bytes, zero source for reads
+#endif
+
+// transaction phase
+#define PHASE_IDLE		0x00
+#define PHASE_HEADER	0x01
+#define PHASE_PAYLOAD	0x02
+#define PHASE_DMA		0x03
+
+static SPITransaction * volatile spiQueue[SPI_QUEUE_SIZE];
+static volatile u_char queueHead = 0, queueTail = 0;
+static volatile u_char phase = PHASE_IDLE;
+static u_int position;	// offset into the current segment
+static u_char frameHeader[3];
+static u_char headerPosition;
+
+// current payload segment, a plain transaction is a single segment
+static u_char segment;
+static u_char segmentDirection;
+static u_char *segmentArray;
+static u_char segmentValue;
+static u_int segmentLength;
+
+#if WIZ_SPI_MODE == WIZ_SPI_FDM
+// fixed length framing, every 4, 2 or 1 payload bytes get their own header
+static u_int frameAddr;
+static u_char frameRemaining;
+static u_int payloadRemaining;
+#endif
+
+static void startTransaction(void);
+static void finishTransaction(void);
+
+/*
+ * Route the eUSCI TX/RX triggers to their DMA channels, RX completion raises DMA_INT1.
+ * Fixed data mode frames are at most 7 bytes and never use DMA, nothing to set up.
+ */
+void configureSPIDMA(void) {
+#if WIZ_SPI_MODE == WIZ_SPI_VDM
+	DMA_enableModule();
+	DMA_setControlBase(dmaControlTable);
+
+	DMA_assignChannel(ETH_DMA_TX_CHANNEL);
+	DMA_assignChannel(ETH_DMA_RX_CHANNEL);
+	DMA_disableChannelAttribute(ETH_DMA_TX_CHANNEL,
+			UDMA_ATTR_ALTSELECT | UDMA_ATTR_USEBURST | UDMA_ATTR_HIGH_PRIORITY
+					| UDMA_ATTR_REQMASK);
+	DMA_disableChannelAttribute(ETH_DMA_RX_CHANNEL,
+			UDMA_ATTR_ALTSELECT | UDMA_ATTR_USEBURST | UDMA_ATTR_HIGH_PRIORITY
+					| UDMA_ATTR_REQMASK);
+
+	DMA_assignInterrupt(DMA_INT1, ETH_DMA_RX_CHANNEL_NUM);
+	DMA_clearInterruptFlag(ETH_DMA_RX_CHANNEL_NUM);
+	DMA_enableInterrupt(INT_DMA_INT1);
+#endif
+}
+
+#if WIZ_SPI_MODE == WIZ_SPI_VDM
+/*
+ * Start one DMA burst of up to ETH_DMA_MAX_TRANSFER bytes of the current segment.
+ * TX feeds the eUSCI, RX drains it, so every received byte is accounted for.
+ */
+static WIZ_RAMFUNC void startBlockDMA(void) {
+	void *txBuffer = (void *) SPI_getTransmitBufferAddressForDMA(
+			ETH_EUSCI_MODULE);
+	void *rxBuffer = (void *) SPI_getReceiveBufferAddressForDMA(
+			ETH_EUSCI_MODULE);
+	u_int block = segmentLength - position;
+	u_char read = (segmentDirection == SPI_READ);
+
+	if (block > ETH_DMA_MAX_TRANSFER)
+		block = ETH_DMA_MAX_TRANSFER;
+
+	DMA_setChannelControl(UDMA_PRI_SELECT | ETH_DMA_RX_CHANNEL,
+			UDMA_SIZE_8 | UDMA_SRC_INC_NONE
+					| (read ? UDMA_DST_INC_8 : UDMA_DST_INC_NONE) | UDMA_ARB_1);
+	DMA_setChannelTransfer(UDMA_PRI_SELECT | ETH_DMA_RX_CHANNEL,
+			UDMA_MODE_BASIC, rxBuffer,
+			read ? segmentArray + position : &dmaDummy, block);
+
+	DMA_setChannelControl(UDMA_PRI_SELECT | ETH_DMA_TX_CHANNEL,
+			UDMA_SIZE_8
+					| (segmentDirection == SPI_WRITE ?
+							UDMA_SRC_INC_8 : UDMA_SRC_INC_NONE)
+					| UDMA_DST_INC_NONE | UDMA_ARB_1);
+	if (segmentDirection == SPI_WRITE) {
+		DMA_setChannelTransfer(UDMA_PRI_SELECT | ETH_DMA_TX_CHANNEL,
+				UDMA_MODE_BASIC, segmentArray + position, txBuffer, block);
+	} else if (segmentDirection == SPI_FILL) {
+		DMA_setChannelTransfer(UDMA_PRI_SELECT | ETH_DMA_TX_CHANNEL,
+				UDMA_MODE_BASIC, &segmentValue, txBuffer, block);
+	} else {
+		// reads clock out zeros, nothing is written into dmaDummy meanwhile
+		dmaDummy = 0;
+		DMA_setChannelTransfer(UDMA_PRI_SELECT | ETH_DMA_TX_CHANNEL,
+				UDMA_MODE_BASIC, &dmaDummy, txBuffer, block);
+	}
+	position += block;
+
+	DMA_enableChannel(ETH_DMA_RX_CHANNEL_NUM);
+	DMA_enableChannel(ETH_DMA_TX_CHANNEL_NUM);
+
+	// channels trigger on the rising edge of TXIFG, which is already high
+	ETH_EUSCI->IFG &= ~EUSCI_A_IFG_TXIFG;
+	ETH_EUSCI->IFG |= EUSCI_A_IFG_TXIFG;
+}
+#endif
+
+static WIZ_RAMFUNC u_char nextPayloadByte(void) {
+	if (segmentDirection == SPI_WRITE)
+		return segmentArray[position];
+	if (segmentDirection == SPI_FILL)
+		return segmentValue;
+	return 0;
+}
+
+/*
+ * Point the segment state at the next non-empty payload segment, 0 when there is none
+ */
+static WIZ_RAMFUNC u_char loadSegment(SPITransaction *t) {
+	const SPIVector *v;
+
+	position = 0;
+	if (t->direction != SPI_VECTOR) {
+		if (segment++ > 0 || t->length == 0)
+			return 0;
+		segmentDirection = t->direction;
+		segmentArray = t->array;
+		segmentValue = t->value;
+		segmentLength = t->length;
+		return 1;
+	}
+	while (segment < t->count && t->vector[segment].length == 0) {
+		segment++;
+	}
+	if (segment >= t->count)
+		return 0;
+	v = &t->vector[segment++];
+	segmentDirection = v->array ? SPI_WRITE : SPI_FILL;
+	segmentArray = (u_char *) v->array;
+	segmentValue = v->value;
+	segmentLength = v->length;
+	return 1;
+}
+
+/*
+ * Deselect, mark done, run the callback and move on to the next transaction
+ */
+static WIZ_RAMFUNC void finishTransaction(void) {
+	SPITransaction *t = spiQueue[queueHead];
+
+	wizDeselect();
+	queueHead = (queueHead + 1) % SPI_QUEUE_SIZE;
+	phase = PHASE_IDLE;
+	t->done = 1;
+	if (t->callback) {
+		t->callback(t);
+	}
+	startTransaction();
+}
+
+#if WIZ_SPI_MODE == WIZ_SPI_VDM
+/*
+ * Header or previous segment is out, continue with the next segment on either path
+ */
+static WIZ_RAMFUNC void startSegment(SPITransaction *t) {
+	if (!loadSegment(t)) {
+		finishTransaction();
+	} else if (segmentLength >= SPI_DMA_THRESHOLD) {
+		SPI_disableInterrupt(ETH_EUSCI_MODULE, ETH_EUSCI_REC_INT);
+		phase = PHASE_DMA;
+		startBlockDMA();
+	} else {
+		phase = PHASE_PAYLOAD;
+		SPI_enableInterrupt(ETH_EUSCI_MODULE, ETH_EUSCI_REC_INT);
+		ETH_EUSCI->TXBUF = nextPayloadByte();
+	}
+}
+#endif
+
+static WIZ_RAMFUNC void sendHeader(void) {
+	phase = PHASE_HEADER;
+	headerPosition = 0;
+	ETH_EUSCI->TXBUF = frameHeader[0];
+}
+
+#if WIZ_SPI_MODE == WIZ_SPI_FDM
+static WIZ_RAMFUNC u_int transactionLength(SPITransaction *t) {
+	u_int length = 0;
+	u_char c;
+
+	if (t->direction != SPI_VECTOR)
+		return t->length;
+	for (c = 0; c < t->count; c++) {
+		length += t->vector[c].length;
+	}
+	return length;
+}
+
+/*
+ * Largest fixed length frame that fits the remaining payload
+ */
+static WIZ_RAMFUNC void startFrame(SPITransaction *t) {
+	u_char mode;
+
+	if (payloadRemaining >= 4) {
+		frameRemaining = 4;
+		mode = OP_FDM_4_BYTE;
+	} else if (payloadRemaining >= 2) {
+		frameRemaining = 2;
+		mode = OP_FDM_2_BYTE;
+	} else {
+		frameRemaining = 1;
+		mode = OP_FDM_1_BYTE;
+	}
+	frameHeader[0] = frameAddr >> 8;
+	frameHeader[1] = frameAddr;
+	frameHeader[2] = t->header[2] | mode;
+	sendHeader();
+}
+
+/*
+ * Send the next payload byte, moving on to the next segment when this one is used up
+ */
+static WIZ_RAMFUNC void continuePayload(SPITransaction *t) {
+	if (position >= segmentLength && !loadSegment(t)) {
+		finishTransaction();
+		return;
+	}
+	phase = PHASE_PAYLOAD;
+	ETH_EUSCI->TXBUF = nextPayloadByte();
+}
+#endif
+
+static WIZ_RAMFUNC void startTransaction(void) {
+	SPITransaction *t;
+
+	if (queueHead == queueTail) {
+		SPI_disableInterrupt(ETH_EUSCI_MODULE, ETH_EUSCI_REC_INT);
+		return;
+	}
+	t = spiQueue[queueHead];
+	segment = 0;
+	position = 0;
+	segmentLength = 0;
+	wizSelect();
+	SPI_clearInterruptFlag(ETH_EUSCI_MODULE, ETH_EUSCI_REC_INT);
+	SPI_enableInterrupt(ETH_EUSCI_MODULE, ETH_EUSCI_REC_INT);
+#if WIZ_SPI_MODE == WIZ_SPI_FDM
+	frameAddr = (t->header[0] << 8) | t->header[1];
+	payloadRemaining = transactionLength(t);
+	if (payloadRemaining == 0) {
+		finishTransaction();
+		return;
+	}
+	startFrame(t);
+#else
+	frameHeader[0] = t->header[0];
+	frameHeader[1] = t->header[1];
+	frameHeader[2] = t->header[2];
+	sendHeader();
+#endif
+}
+
+/*
+ * One byte came back, send the next one
+ */
+static WIZ_RAMFUNC void serviceByte(void) {
+	SPITransaction *t = spiQueue[queueHead];
+	u_char byte = ETH_EUSCI->RXBUF;
+
+	if (phase == PHASE_HEADER) {
+		if (++headerPosition < 3) {
+			ETH_EUSCI->TXBUF = frameHeader[headerPosition];
+		} else {
+#if WIZ_SPI_MODE == WIZ_SPI_FDM
+			continuePayload(t);
+#else
+			startSegment(t);
+#endif
+		}
+	} else if (phase == PHASE_PAYLOAD) {
+		if (segmentDirection == SPI_READ) {
+			segmentArray[position] = byte;
+		}
+		position++;
+#if WIZ_SPI_MODE == WIZ_SPI_FDM
+		frameAddr++;
+		if (--payloadRemaining == 0) {
+			finishTransaction();
+		} else if (--frameRemaining == 0) {
+			startFrame(t);
+		} else {
+			continuePayload(t);
+		}
+#else
+		if (position < segmentLength) {
+			ETH_EUSCI->TXBUF = nextPayloadByte();
+		} else {
+			startSegment(t);
+		}
+#endif
+	}
+}
+
+#if WIZ_SPI_MODE == WIZ_SPI_VDM
+static WIZ_RAMFUNC void serviceDMA(void) {
+	SPITransaction *t = spiQueue[queueHead];
+
+	DMA_clearInterruptFlag(ETH_DMA_RX_CHANNEL_NUM);
+	if (phase != PHASE_DMA || DMA_isChannelEnabled(ETH_DMA_RX_CHANNEL_NUM)) {
+		return;
+	}
+	if (position < segmentLength) {
+		startBlockDMA();
+	} else {
+		startSegment(t);
+	}
+}
+#endif
+
+WIZ_RAMFUNC void EUSCIA3_IRQHandler(void) {
+	if ((ETH_EUSCI->IE & EUSCI_A_IE_RXIE) && (ETH_EUSCI->IFG & EUSCI_A_IFG_RXIFG)) {
+		serviceByte();
+	}
+}
+
+#if WIZ_SPI_MODE == WIZ_SPI_VDM
+WIZ_RAMFUNC void DMA_INT1_IRQHandler(void) {
+	serviceDMA();
+}
+#endif
+
+/*
+ * Interrupts are masked, run the state machine by hand
+ */
+static WIZ_RAMFUNC void pollSPI(void) {
+#if WIZ_SPI_MODE == WIZ_SPI_VDM
+	if (phase == PHASE_DMA) {
+		if (!DMA_isChannelEnabled(ETH_DMA_RX_CHANNEL_NUM)) {
+			serviceDMA();
+		}
+		return;
+	}
+#endif
+	if (phase != PHASE_IDLE && (ETH_EUSCI->IFG & EUSCI_A_IFG_RXIFG)) {
+		serviceByte();
+	}
+}
+
+WIZ_RAMFUNC void setupSPITransaction(SPITransaction *transaction, u_int addr,
+		u_char control, u_char direction, u_char *array, u_int length) {
+	transaction->header[0] = addr >> 8;
+	transaction->header[1] = addr;
+	transaction->header[2] =
+			direction == SPI_READ ? control : control | RWB_WRITE;
+	transaction->direction = direction;
+	transaction->array = array;
+	transaction->value = 0;
+	transaction->length = length;
+	transaction->vector = 0;
+	transaction->count = 0;
+	transaction->callback = 0;
+	transaction->done = 0;
+}
+
+/*
+ * Queue a transaction, starting the bus if it was idle.
+ * Waits for a free slot when the queue is full.
+ */
+WIZ_RAMFUNC void submitSPITransaction(SPITransaction *transaction) {
+	u_int primask;
+	u_char next;
+
+	WIZ_ASSERT_THREAD();
+	transaction->done = 0;
+	next = (queueTail + 1) % SPI_QUEUE_SIZE;
+	while (next == queueHead) {
+		if (CPU_primask()) {
+			pollSPI();
+		}
+	}
+
+	primask = CPU_cpsid();
+	spiQueue[queueTail] = transaction;
+	queueTail = next;
+	if (phase == PHASE_IDLE) {
+		startTransaction();
+	}
+	if (!primask) {
+		CPU_cpsie();
+	}
+}
+
+WIZ_RAMFUNC void waitSPITransaction(SPITransaction *transaction) {
+	WIZ_ASSERT_THREAD();
+	while (!transaction->done) {
+		if (CPU_primask()) {
+			pollSPI();
+		}
+	}
+}
+
+WIZ_RAMFUNC void runSPITransaction(SPITransaction *transaction) {
+	submitSPITransaction(transaction);
+	waitSPITransaction(transaction);
+}
+
+u_char isSPIIdle(void) {
+	return phase == PHASE_IDLE;
+}
+
+void waitSPIIdle(void) {
+	WIZ_ASSERT_THREAD();
+	while (phase != PHASE_IDLE) {
+		if (CPU_primask()) {
+			pollSPI();
+		}
+	}
+}
+
+/*
+ * Reprogram the bit clock divider once the queue is idle, returns the clock actually set
+ */
+u_long setSPIClock(u_long hz) {
+	u_long source = MAP_CS_getSMCLK();
+	u_long divider = source / hz;
+
+	if (divider == 0)
+		divider = 1;
+	waitSPIIdle();
+	SPI_changeMasterClock(ETH_EUSCI_MODULE, source, hz);
+	return source / divider;
+}
@@ -0,0 +1,62 @@
+/*
+ * wizspi.h
+ *
+ * Interrupt driven SPI transaction queue for the W5500
+ */
+
+#ifndef WIZSPI_H_
+#define WIZSPI_H_
+
+#include <assert.h>
+#include "typedefs.h"
+
+// submit and the waits spin on the queue's own interrupts, thread mode only
+#define WIZ_ASSERT_THREAD()		assert(__get_IPSR() == 0)
+
+// transaction direction
+#define SPI_READ				0x00
+#define SPI_WRITE				0x01
+#define SPI_FILL				0x02	// write the same byte length times
+#define SPI_VECTOR				0x03	// write a list of SPIVector segments
+
+/*
+ * Scatter-gather segment, array 0 means a run of length value bytes
+ */
+typedef struct {
+	const u_char *array;
+	u_char value;
+	u_int length;
+} SPIVector;
+
+typedef struct SPITransaction SPITransaction;
+typedef void (*SPICallback)(SPITransaction *transaction);
+
+/*
+ * One W5500 SPI frame: 3 byte address/control header plus payload.
+ * The transaction belongs to the queue from submit until done is set,
+ * callbacks run in interrupt context and must not wait on the queue.
+ */
+struct SPITransaction {
+	u_char header[3];
+	u_char direction;
+	u_char *array;
+	u_char value;			// fill value for SPI_FILL
+	u_int length;
+	const SPIVector *vector;	// SPI_VECTOR segments, replaces array/value/length
+	u_char count;
+	SPICallback callback;	// optional
+	volatile u_char done;
+};
+
+void configureSPIDMA(void);
+u_long setSPIClock(u_long hz);
+//
+void setupSPITransaction(SPITransaction *transaction, u_int addr,
+		u_char control, u_char direction, u_char *array, u_int length);
+void submitSPITransaction(SPITransaction *transaction);
+void waitSPITransaction(SPITransaction *transaction);
+void runSPITransaction(SPITransaction *transaction); // submit and wait
+u_char isSPIIdle(void);
+void waitSPIIdle(void);
+
+#endif /* WIZSPI_H_ */